@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Arena allocator.
+ */
+#include "arena.h"
+#include "msg.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of each block, bigger allocations get their own block
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN sizeof(max_align_t)
+
+struct arena_block
+{
+    struct arena_block *prev;
+    size_t size;
+    max_align_t data[];
+};
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if( size > ARENA_BLOCK / 4 )
+    {
+        // Insert the new block behind the current one, keeping its free space
+        struct arena_block *b = check_malloc(sizeof(struct arena_block) + size);
+        b->size               = size;
+        if( a->block )
+        {
+            b->prev        = a->block->prev;
+            a->block->prev = b;
+        }
+        else
+        {
+            b->prev  = 0;
+            a->block = b;
+            a->used  = size;
+        }
+        return b->data;
+    }
+    if( !a->block || a->used + size > a->block->size )
+    {
+        struct arena_block *b = check_malloc(sizeof(struct arena_block) + ARENA_BLOCK);
+        b->prev               = a->block;
+        b->size               = ARENA_BLOCK;
+        a->block              = b;
+        a->used               = 0;
+    }
+    void *ret = (uint8_t *)a->block->data + a->used;
+    a->used += size;
+    return ret;
+}
+
+char *arena_strdup(struct arena *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(a, len), str, len);
+}
+
+void arena_free(struct arena *a)
+{
+    while( a->block )
+    {
+        struct arena_block *b = a->block;
+        a->block              = b->prev;
+        free(b);
+    }
+    a->used = 0;
+}
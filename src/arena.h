@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Arena allocator, for many small allocations released all at once.
+ */
+#pragma once
+#include <stddef.h>
+
+struct arena_block;
+
+// Initialize with all zeros
+struct arena
+{
+    struct arena_block *block; // Current block, linked to the previous ones
+    size_t used;               // Bytes used in the current block
+};
+
+// Returns "size" bytes from the arena, aligned for any type.
+void *arena_alloc(struct arena *a, size_t size);
+// Returns a copy of the string allocated from the arena.
+char *arena_strdup(struct arena *a, const char *str);
+// Frees all the memory allocated from the arena.
+void arena_free(struct arena *a);
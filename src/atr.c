@@ -26,17 +26,428 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#if !( defined(_WIN32) || defined(__WIN32__) )
+#define ATR_POSIX_IO 1
+#include <sys/mman.h>
+#else
+#include <io.h>
+#endif
+
+// Returns the first of the three boot sectors with data over 128 bytes, or 0
+// if the padding is all zeros.
+static unsigned bad_padding(const uint8_t *data)
+{
+    for( unsigned i = 0; i < 3; i++ )
+    {
+        int chk = 0;
+        for( unsigned j = 0; j < 128; j++ )
+            chk += data[i * 256 + j + 128];
+        if( chk != 0 )
+            return i + 1;
+    }
+    return 0;
+}
+
+// Fix images with 256 byte sectors that store the first 3 sectors as 128
+// bytes, but with an image size that does not account for it.
+static void fix_padding(uint8_t *data, unsigned ssz, unsigned num_sectors)
+{
+    // Try to detect and fixing bad image
+    // Check zeros at end:
+    int chk1 = 0;
+    for( unsigned i = 0; i < 384; i++ )
+        chk1 += data[ssz * num_sectors - 384 + i];
+    // Check zeros after first 3 sectors:
+    int chk2 = 0;
+    for( unsigned i = 0; i < 384; i++ )
+        chk2 += data[384 + i];
+
+    if( !chk1 && chk2 )
+    {
+        memmove(data + 3 * 256, data + 3 * 128, ssz * (num_sectors - 3));
+        memmove(data + 2 * 256, data + 2 * 128, 128);
+        memmove(data + 1 * 256, data + 1 * 128, 128);
+    }
+    else if( !chk2 )
+    {
+        memmove(data + 3 * 256, data + 3 * 128, 128);
+        memmove(data + 2 * 256, data + 2 * 128, 128);
+        memmove(data + 1 * 256, data + 1 * 128, 128);
+    }
+    // Clear remaining space
+    memset(data + 2 * 256 + 128, 0, 128);
+    memset(data + 1 * 256 + 128, 0, 128);
+    memset(data + 0 * 256 + 128, 0, 128);
+}
+
+static struct atr_image *new_image(unsigned ssz, unsigned num_sectors)
+{
+    struct atr_image *atr = check_calloc(1, sizeof(struct atr_image));
+    atr->sec_size         = ssz;
+    atr->sec_count        = num_sectors;
+    return atr;
+}
+
+// Maps "size" bytes of the file, returns 0 if not possible. Writable mappings
+// are private, changes are not written to the file.
+static void *map_file(FILE *f, size_t size, int writable)
+{
+#ifdef ATR_POSIX_IO
+    void *map = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE,
+                     fileno(f), 0);
+    if( map == MAP_FAILED )
+        return 0;
+    return map;
+#else
+    return 0;
+#endif
+}
+
+static void unmap_file(void *map, size_t size)
+{
+#ifdef ATR_POSIX_IO
+    munmap(map, size);
+#endif
+}
+
+// Returns the image using the file mapping, or 0 if the file can't be mapped
+// or needs fixing.
+static struct atr_image *map_image(FILE *f, off_t fsize, size_t offset, unsigned ssz,
+                                   unsigned num_sectors, unsigned pad_size, int writable)
+{
+    // Check that all sectors are present in the file
+    size_t dsize = (size_t)ssz * num_sectors - pad_size;
+    if( fsize < 0 || (uint64_t)fsize < offset + dsize || !dsize )
+        return 0;
+
+    uint8_t *map = map_file(f, offset + dsize, writable);
+    if( !map )
+        return 0;
+
+    // Images that store the 3 first sectors as 256 bytes need fixing if the
+    // padding is not zero.
+    if( ssz == 256 && !pad_size && num_sectors > 3 && bad_padding(map + offset) )
+    {
+        unmap_file(map, offset + dsize);
+        return 0;
+    }
+
+    struct atr_image *atr = new_image(ssz, num_sectors);
+    atr->data             = map + offset;
+    atr->map              = map;
+    atr->map_size         = offset + dsize;
+    atr->pad_size         = pad_size;
+    if( pad_size )
+    {
+        // Copy the 3 boot sectors to the padded buffer
+        atr->boot = check_calloc(3, ssz);
+        for( unsigned i = 0; i < 3 && i < num_sectors; i++ )
+            memcpy(atr->boot + ssz * i, atr->data + 128 * i, 128);
+    }
+    return atr;
+}
+
+// Sector cache for images read on demand
+#define CACHE_HASH (2 * ATR_CACHE_SECTORS)
+struct atr_lazy
+{
+    int fd;
+    size_t offset;                       // File offset of first sector
+    uint8_t *data;                       // Sector buffers
+    unsigned sect[ATR_CACHE_SECTORS];    // Sector in each buffer, 0 = none
+    unsigned long used[ATR_CACHE_SECTORS]; // Last access, for LRU replacement
+    int hnext[ATR_CACHE_SECTORS];        // Next buffer in the hash chain
+    int hash[CACHE_HASH];                // First buffer for each hash value
+    unsigned long clock;
+};
+
+// Returns file offset and length of the given sector.
+static size_t sector_pos(const struct atr_image *atr, size_t offset, unsigned sector,
+                         unsigned *len)
+{
+    if( sector <= 3 && atr->pad_size )
+    {
+        *len = 128;
+        return offset + 128 * (sector - 1);
+    }
+    *len = atr->sec_size;
+    return offset + (size_t)atr->sec_size * (sector - 1) - atr->pad_size;
+}
+
+// Reads bytes from the file, filling with zeros past the end of file.
+static void read_at(int fd, uint8_t *buf, size_t len, size_t pos)
+{
+#ifdef ATR_POSIX_IO
+    while( len )
+    {
+        ssize_t n = pread(fd, buf, len, pos);
+        if( n <= 0 )
+            break;
+        buf += n;
+        pos += n;
+        len -= n;
+    }
+#endif
+    memset(buf, 0, len);
+}
+
+static const uint8_t *lazy_data(const struct atr_image *atr, unsigned sector)
+{
+    struct atr_lazy *lz = atr->lazy;
+    unsigned ssz        = atr->sec_size;
+    int h               = sector % CACHE_HASH;
+    for( int i = lz->hash[h]; i >= 0; i = lz->hnext[i] )
+    {
+        if( lz->sect[i] == sector )
+        {
+            lz->used[i] = ++lz->clock;
+            return lz->data + ssz * i;
+        }
+    }
+    // Not in cache, replace the least recently used buffer
+    int slot = 0;
+    for( int i = 1; i < ATR_CACHE_SECTORS; i++ )
+        if( lz->used[i] < lz->used[slot] )
+            slot = i;
+    if( lz->sect[slot] )
+    {
+        int *p = &lz->hash[lz->sect[slot] % CACHE_HASH];
+        while( *p != slot )
+            p = &lz->hnext[*p];
+        *p = lz->hnext[slot];
+    }
+    unsigned len;
+    size_t pos     = sector_pos(atr, lz->offset, sector, &len);
+    uint8_t *data  = lz->data + ssz * slot;
+    read_at(lz->fd, data, len, pos);
+    memset(data + len, 0, ssz - len);
+    lz->sect[slot]  = sector;
+    lz->used[slot]  = ++lz->clock;
+    lz->hnext[slot] = lz->hash[h];
+    lz->hash[h]     = slot;
+    return data;
+}
+
+// Returns the image reading sectors on demand, or 0 if not possible or the
+// image needs fixing.
+// Returns true if the image stores the 3 first sectors as 256 bytes and needs
+// fixing because the padding is not zero.
+static int lazy_bad_padding(int fd, const struct atr_geometry *geo)
+{
+    if( geo->sec_size != 256 || geo->pad_size || geo->sec_count <= 3 )
+        return 0;
+    uint8_t boot[768];
+    read_at(fd, boot, sizeof(boot), geo->offset);
+    return bad_padding(boot) != 0;
+}
+
+static struct atr_image *lazy_image(const char *file_name, FILE *f, off_t fsize,
+                                    const struct atr_geometry *geo)
+{
+#ifdef ATR_POSIX_IO
+    struct atr_image tmp = { 0 };
+    tmp.sec_size         = geo->sec_size;
+    tmp.pad_size         = geo->pad_size;
+
+    // Fixed by the copy path, showing the message
+    if( lazy_bad_padding(fileno(f), geo) )
+        return 0;
+
+    // Report short files as the copy path does
+    for( unsigned i = 1; i <= geo->sec_count; i++ )
+    {
+        unsigned len;
+        if( (uint64_t)fsize < sector_pos(&tmp, geo->offset, i, &len) + len )
+        {
+            show_msg("%s: ATR file too short at sector %d", file_name, i);
+            break;
+        }
+    }
+
+    int fd = dup(fileno(f));
+    if( fd < 0 )
+        return 0;
+    return atr_lazy_fd(fd, geo);
+#else
+    return 0;
+#endif
+}
+
+struct atr_image *atr_lazy_fd(int fd, const struct atr_geometry *geo)
+{
+#ifdef ATR_POSIX_IO
+    unsigned ssz = geo->sec_size;
+    if( lazy_bad_padding(fd, geo) )
+    {
+        // Read the full image and fix it
+        uint8_t *data = check_calloc(ssz, geo->sec_count);
+        read_at(fd, data, (size_t)ssz * geo->sec_count, geo->offset);
+        fix_padding(data, ssz, geo->sec_count);
+        close(fd);
+        struct atr_image *atr = new_image(ssz, geo->sec_count);
+        atr->data             = data;
+        return atr;
+    }
+
+    struct atr_lazy *lz = check_calloc(1, sizeof(struct atr_lazy));
+    lz->fd              = fd;
+    lz->offset          = geo->offset;
+    lz->data            = check_calloc(ATR_CACHE_SECTORS, ssz);
+    for( int i = 0; i < CACHE_HASH; i++ )
+        lz->hash[i] = -1;
+
+    struct atr_image *atr = new_image(ssz, geo->sec_count);
+    atr->pad_size         = geo->pad_size;
+    atr->lazy             = lz;
+    return atr;
+#else
+    return 0;
+#endif
+}
+
+// State of writable images
+struct atr_write
+{
+    int fd;
+    size_t offset;       // File offset of first sector
+    unsigned pad_size;   // Bytes missing from first 3 sectors in the file
+    unsigned file_count; // Number of sectors in the file
+    uint8_t *dirty;      // One bit per modified sector
+    uint8_t *pass;       // Pass of atr_commit() writing each sector, if set
+    unsigned passes;     // Number of passes
+    unsigned data_count; // Sectors in the image data, the rest are in "extra"
+    uint8_t *extra;      // Sectors added by atr_resize()
+};
+
+static int is_dirty(const struct atr_write *w, unsigned sector)
+{
+    return w->dirty[sector >> 3] & (1 << (sector & 7));
+}
+
+static unsigned sector_pass(const struct atr_write *w, unsigned sector)
+{
+    return w->pass ? w->pass[sector] : 0;
+}
+
+// Flush file data to disk
+static int sync_fd(int fd)
+{
+#ifdef ATR_POSIX_IO
+    return fsync(fd);
+#else
+    return _commit(fd);
+#endif
+}
+
+// Writes bytes to the file at the given position, returns 0 on success.
+static int write_at(int fd, const uint8_t *buf, size_t len, size_t pos)
+{
+#ifndef ATR_POSIX_IO
+    if( lseek(fd, pos, SEEK_SET) < 0 )
+        return -1;
+#endif
+    while( len )
+    {
+#ifdef ATR_POSIX_IO
+        ssize_t n = pwrite(fd, buf, len, pos);
+#else
+        ssize_t n = write(fd, buf, len);
+#endif
+        if( n <= 0 )
+            return -1;
+        buf += n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Finish opening the image, keeping the file open if writable.
+static struct atr_image *opened(struct atr_image *atr, const char *file_name, FILE *f,
+                                enum atr_mode mode, size_t offset, unsigned pad_size)
+{
+    if( mode == atr_load_write )
+    {
+        int fd = dup(fileno(f));
+        if( fd < 0 )
+        {
+            show_msg("%s: can't open for writing: %s", file_name, strerror(errno));
+            fclose(f);
+            atr_free(atr);
+            return 0;
+        }
+        struct atr_write *w = check_calloc(1, sizeof(struct atr_write));
+        w->fd               = fd;
+        w->offset           = offset;
+        w->pad_size         = pad_size;
+        w->file_count       = atr->sec_count;
+        w->data_count       = atr->sec_count;
+        w->dirty            = check_calloc(1, atr->sec_count / 8 + 1);
+        atr->write          = w;
+    }
+    fclose(f);
+    return atr;
+}
+
+enum atr_header atr_parse_header(const uint8_t *hdr, off_t fsize, struct atr_geometry *geo)
+{
+    memset(geo, 0, sizeof(*geo));
+    if( hdr[0] != 0x96 || hdr[1] != 0x02 )
+    {
+        // Raw SS/SD or SD/ED image, only recognized by the size
+        if( fsize != 720 * 128 && fsize != 1040 * 128 )
+            return atr_header_raw;
+        geo->sec_size  = 128;
+        geo->sec_count = fsize / 128;
+        return atr_header_ok;
+    }
+    unsigned ssz = hdr[4] | (hdr[5] << 8);
+    if( ssz != 128 && ssz != 256 )
+        return atr_header_sector_size;
+    // Some images store full size fo the first 3 sectors, others store
+    // 128 bytes for those:
+    unsigned isz      = (hdr[2] << 4) | (hdr[3] << 12) | (hdr[6] << 20);
+    unsigned pad_size = (isz % ssz) ? 3 * (ssz - 128) : 0;
+    unsigned num_sectors = (isz + pad_size) / ssz;
+    geo->sec_size = ssz;
+    geo->offset   = 16;
+    geo->size     = isz;
+    if( isz >= 0x1000000 || num_sectors * ssz - pad_size != isz )
+    {
+        // If image size is invalid, assume sector padding:
+        pad_size    = 3 * (ssz - 128);
+        num_sectors = (isz + pad_size) / ssz;
+        if( num_sectors > 65535 )
+            num_sectors = 65535;
+        if( num_sectors < 3 )
+            return atr_header_too_small;
+        geo->rounded = 1;
+    }
+    geo->sec_count = num_sectors;
+    geo->pad_size  = pad_size;
+    return atr_header_ok;
+}
 
 // Load disk image from file
-struct atr_image *load_atr_image(const char *file_name)
+struct atr_image *atr_open(const char *file_name, enum atr_mode mode)
 {
-    FILE *f = fopen(file_name, "rb");
+    FILE *f = fopen(file_name, mode == atr_load_write ? "r+b" : "rb");
     if( !f )
     {
         show_error("can't open disk image '%s': %s", file_name, strerror(errno));
         return 0;
     }
 
+    // Get file size, used to check if we can map the file
+    struct stat st;
+    off_t fsize = -1;
+    if( mode != atr_load_copy && 0 == fstat(fileno(f), &st) && S_ISREG(st.st_mode) )
+        fsize = st.st_size;
+
     // Get header
     uint8_t hdr[16];
     if( 1 != fread(hdr, 16, 1, f) )
@@ -45,7 +456,35 @@ struct atr_image *load_atr_image(const char *file_name)
         fclose(f);
         return 0;
     }
-    if( hdr[0] != 0x96 || hdr[1] != 0x02 )
+    struct atr_geometry geo;
+    enum atr_header h = atr_parse_header(hdr, fsize, &geo);
+    if( h == atr_header_sector_size )
+    {
+        show_error("%s: unsupported ATR sector size (%d)", file_name, hdr[4] | (hdr[5] << 8));
+        fclose(f);
+        return 0;
+    }
+    if( h == atr_header_too_small )
+        show_error("%s: invalid ATR image size (%d), too small.", file_name, geo.size);
+    unsigned ssz         = geo.sec_size;
+    unsigned num_sectors = geo.sec_count;
+    unsigned pad_size    = geo.pad_size;
+    if( h == atr_header_ok && geo.rounded )
+        show_msg("%s: invalid ATR image size (%d), rounding down to (%d)", file_name, geo.size,
+                 num_sectors * ssz - pad_size);
+
+    // Try to use the file mapping or to read on demand
+    if( h == atr_header_ok && fsize >= 0 )
+    {
+        struct atr_image *atr =
+            mode == atr_load_lazy
+                ? lazy_image(file_name, f, fsize, &geo)
+                : map_image(f, fsize, geo.offset, ssz, num_sectors, pad_size,
+                            mode == atr_load_write);
+        if( atr )
+            return opened(atr, file_name, f, mode, geo.offset, pad_size);
+    }
+    if( h == atr_header_raw || !geo.offset )
     {
         // Check if we can open as a raw SS/SD or SD/ED image
         uint8_t *data = check_calloc(1, 128 * 1040 + 16);
@@ -61,46 +500,9 @@ struct atr_image *load_atr_image(const char *file_name)
             free(data);
             return 0;
         }
-        fclose(f);
-        struct atr_image *atr = check_malloc(sizeof(struct atr_image));
+        struct atr_image *atr = new_image(128, num / 128);
         atr->data             = data;
-        atr->sec_size         = 128;
-        atr->sec_count        = num / 128;
-        return atr;
-    }
-    unsigned ssz = hdr[4] | (hdr[5] << 8);
-    if( ssz != 128 && ssz != 256 )
-    {
-        show_error("%s: unsupported ATR sector size (%d)", file_name, ssz);
-        fclose(f);
-        return 0;
-    }
-    unsigned isz = (hdr[2] << 4) | (hdr[3] << 12) | (hdr[6] << 20);
-    // Some images store full size fo the first 3 sectors, others store
-    // 128 bytes for those:
-    // Check for overflow in pad_size calculation
-    unsigned pad_size = 0;
-    if( isz % ssz != 0 )
-    {
-        if( ssz < 128 || (ssz - 128) > UINT_MAX / 3 )
-            show_error("%s: invalid sector size for padding calculation", file_name);
-        pad_size = (ssz - 128) * 3;
-        // Check for overflow in addition
-        if( isz > UINT_MAX - pad_size )
-            show_error("%s: image size too large", file_name);
-    }
-    unsigned num_sectors = (isz + pad_size) / ssz;
-    if( isz >= 0x1000000 || num_sectors * ssz - pad_size != isz )
-    {
-        // If image size is invalid, assume sector padding:
-        pad_size    = 3 * (ssz - 128);
-        num_sectors = (isz + pad_size) / ssz;
-        if( num_sectors > 65535 )
-            num_sectors = 65535;
-        if( num_sectors < 3 )
-            show_error("%s: invalid ATR image size (%d), too small.", file_name, isz);
-        show_msg("%s: invalid ATR image size (%d), rounding down to (%d)", file_name, isz,
-                 num_sectors * ssz - pad_size);
+        return opened(atr, file_name, f, mode, 0, 0);
     }
     // Check for overflow in allocation size
     if( num_sectors > SIZE_MAX / ssz )
@@ -119,62 +521,57 @@ struct atr_image *load_atr_image(const char *file_name)
     // Check that sector paddings are 0
     if( ssz == 256 && num_sectors > 3 )
     {
-        int chk = 0;
-        for( unsigned i = 0; i < 3; i++ )
-        {
-            chk = 0;
-            for( unsigned j = 0; j < 128; j++ )
-                chk += data[i * 256 + j + 128];
-            if( chk != 0 )
-            {
-                show_msg("%s: ATR suspect - sector %d has data over 128 bytes, fixing.",
-                         file_name, i + 1);
-                break;
-            }
-        }
-        if( chk )
+        unsigned bad = bad_padding(data);
+        if( bad )
         {
-            // Try to detect and fixing bad image
-            // Check zeros at end:
-            int chk1 = 0;
-            for( unsigned i = 0; i < 384; i++ )
-                chk1 += data[ssz * num_sectors - 384 + i];
-            // Check zeros after first 3 sectors:
-            int chk2 = 0;
-            for( unsigned i = 0; i < 384; i++ )
-                chk2 += data[384 + i];
-
-            if( !chk1 && chk2 )
-            {
-                memmove(data + 3 * 256, data + 3 * 128, ssz * (num_sectors - 3));
-                memmove(data + 2 * 256, data + 2 * 128, 128);
-                memmove(data + 1 * 256, data + 1 * 128, 128);
-            }
-            else if( !chk2 )
+            if( mode == atr_load_write )
             {
-                memmove(data + 3 * 256, data + 3 * 128, 128);
-                memmove(data + 2 * 256, data + 2 * 128, 128);
-                memmove(data + 1 * 256, data + 1 * 128, 128);
+                show_msg("%s: ATR suspect - sector %d has data over 128 bytes, can't modify.",
+                         file_name, bad);
+                free(data);
+                fclose(f);
+                return 0;
             }
-            // Clear remaining space
-            memset(data + 2 * 256 + 128, 0, 128);
-            memset(data + 1 * 256 + 128, 0, 128);
-            memset(data + 0 * 256 + 128, 0, 128);
+            show_msg("%s: ATR suspect - sector %d has data over 128 bytes, fixing.",
+                     file_name, bad);
+            fix_padding(data, ssz, num_sectors);
         }
     }
-    fclose(f);
     // Ok, copy to image
-    struct atr_image *atr = check_malloc(sizeof(struct atr_image));
+    struct atr_image *atr = new_image(ssz, num_sectors);
     atr->data             = data;
-    atr->sec_size         = ssz;
-    atr->sec_count        = num_sectors;
-    return atr;
+    return opened(atr, file_name, f, mode, 16, pad_size);
+}
+
+struct atr_image *load_atr_image(const char *file_name)
+{
+    return atr_open(file_name, atr_load_map);
 }
 
 void atr_free(struct atr_image *atr)
 {
-    if( atr->data )
+    if( atr->map )
+        unmap_file(atr->map, atr->map_size);
+    else if( atr->data )
         free((uint8_t *)(atr->data));
+    if( atr->lazy )
+    {
+#ifdef ATR_POSIX_IO
+        close(atr->lazy->fd);
+#endif
+        free(atr->lazy->data);
+        free(atr->lazy);
+    }
+    if( atr->write )
+    {
+        close(atr->write->fd);
+        free(atr->write->dirty);
+        free(atr->write->pass);
+        free(atr->write->extra);
+        free(atr->write);
+    }
+    free(atr->boot);
+    free(atr->range);
     free(atr);
 }
 
@@ -182,6 +579,148 @@ const uint8_t *atr_data(const struct atr_image *atr, unsigned sector)
 {
     if( sector < 1 || sector > atr->sec_count )
         return 0;
+    else if( atr->lazy )
+        return lazy_data(atr, sector);
+    else if( atr->write && sector > atr->write->data_count )
+        return atr->write->extra + (size_t)atr->sec_size * (sector - atr->write->data_count - 1);
+    else if( sector <= 3 && atr->boot )
+        return atr->boot + (sector - 1) * atr->sec_size;
+    else
+        return atr->data + (sector - 1) * atr->sec_size - atr->pad_size;
+}
+
+const uint8_t *atr_data_range(struct atr_image *atr, unsigned sector, unsigned count)
+{
+    if( sector < 1 || !count || count > atr->sec_count || sector > atr->sec_count - count + 1 )
+        return 0;
+    // Data in memory is contiguous after the boot sectors, and in the sectors
+    // added by atr_resize()
+    const struct atr_write *w = atr->write;
+    if( !atr->lazy && (sector > 3 || !atr->boot) &&
+        (!w || sector > w->data_count || sector + count - 1 <= w->data_count) )
+        return atr_data(atr, sector);
+
+    size_t size = (size_t)atr->sec_size * count;
+    if( atr->range_size < size )
+    {
+        atr->range      = check_realloc(atr->range, size);
+        atr->range_size = size;
+    }
+    if( atr->lazy && (sector > 3 || !atr->pad_size) )
+    {
+        // Read all sectors at once
+        unsigned len;
+        read_at(atr->lazy->fd, atr->range, size,
+                sector_pos(atr, atr->lazy->offset, sector, &len));
+    }
     else
-        return atr->data + (sector - 1) * atr->sec_size;
+    {
+        for( unsigned i = 0; i < count; i++ )
+            memcpy(atr->range + atr->sec_size * i, atr_data(atr, sector + i),
+                   atr->sec_size);
+    }
+    return atr->range;
+}
+
+uint8_t *atr_data_rw(struct atr_image *atr, unsigned sector)
+{
+    if( !atr->write || sector < 1 || sector > atr->sec_count )
+        return 0;
+    atr->write->dirty[sector >> 3] |= 1 << (sector & 7);
+    return (uint8_t *)atr_data(atr, sector);
+}
+
+int atr_resize(struct atr_image *atr, unsigned sec_count)
+{
+    struct atr_write *w = atr->write;
+    // Raw images have no header to store the new size, and images with 256 byte
+    // sectors must store the first 3 as 128 bytes.
+    if( !w || !w->offset || (atr->sec_size == 256 && !w->pad_size) ||
+        sec_count < atr->sec_count || sec_count > 65535 )
+        return -1;
+    if( sec_count == atr->sec_count )
+        return 0;
+
+    // Keep the new sectors apart, the image data stays as loaded
+    unsigned old = atr->sec_count;
+    size_t ssz   = atr->sec_size;
+    w->extra     = check_realloc(w->extra, ssz * (sec_count - w->data_count));
+    memset(w->extra + ssz * (old - w->data_count), 0, ssz * (sec_count - old));
+    atr->sec_count = sec_count;
+
+    w->dirty = check_realloc(w->dirty, sec_count / 8 + 1);
+    memset(w->dirty + old / 8 + 1, 0, sec_count / 8 - old / 8);
+    if( w->pass )
+    {
+        w->pass = check_realloc(w->pass, sec_count + 1);
+        memset(w->pass + old + 1, 0, sec_count - old);
+    }
+    return 0;
+}
+
+void atr_commit_pass(struct atr_image *atr, unsigned sector, unsigned pass)
+{
+    struct atr_write *w = atr->write;
+    if( !w || sector < 1 || sector > atr->sec_count || pass > 255 )
+        return;
+    if( !w->pass )
+        w->pass = check_calloc(1, atr->sec_count + 1);
+    w->pass[sector] = pass;
+    if( pass >= w->passes )
+        w->passes = pass + 1;
+}
+
+int atr_commit(struct atr_image *atr)
+{
+    struct atr_write *w = atr->write;
+    if( !w )
+        return -1;
+
+    struct atr_image tmp = { 0 };
+    tmp.sec_size         = atr->sec_size;
+    tmp.pad_size         = w->pad_size;
+
+    if( atr->sec_count != w->file_count )
+    {
+        // Store new size in the header, and add zero sectors at the end of
+        // the file, dropping any extra data after the old image
+        unsigned ssz   = atr->sec_size;
+        size_t old_end = w->offset + (size_t)ssz * w->file_count - w->pad_size;
+        size_t size    = (size_t)ssz * atr->sec_count - w->pad_size;
+        uint8_t hdr[7] = { 0x96, 0x02, size >> 4, size >> 12, ssz, ssz >> 8, size >> 20 };
+        if( write_at(w->fd, hdr, sizeof(hdr), 0) || ftruncate(w->fd, old_end) ||
+            ftruncate(w->fd, w->offset + size) )
+            return -1;
+        w->file_count = atr->sec_count;
+    }
+
+    // Write each run of modified sectors, joining consecutive sectors that are
+    // also consecutive in memory and in the file. Each pass is flushed to disk
+    // before starting the next, so a crash never leaves a later pass written
+    // without the earlier ones.
+    unsigned passes = w->passes ? w->passes : 1;
+    for( unsigned p = 0; p < passes; p++ )
+    {
+        for( unsigned i = 1; i <= atr->sec_count; i++ )
+        {
+            if( !is_dirty(w, i) || sector_pass(w, i) != p )
+                continue;
+            unsigned len, n = 1;
+            size_t pos = sector_pos(&tmp, w->offset, i, &len);
+            if( i > 3 || (!w->pad_size && !atr->boot) )
+            {
+                while( i + n <= atr->sec_count && i + n != w->data_count + 1 &&
+                       is_dirty(w, i + n) && sector_pass(w, i + n) == p )
+                    n++;
+                len = atr->sec_size * n;
+            }
+            if( write_at(w->fd, atr_data(atr, i), len, pos) )
+                return -1;
+            i += n - 1;
+        }
+        if( sync_fd(w->fd) )
+            return -1;
+    }
+    memset(w->dirty, 0, atr->sec_count / 8 + 1);
+    return 0;
 }
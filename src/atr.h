@@ -18,15 +18,92 @@
  * Load ATR files.
  */
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+// How the image data is accessed
+enum atr_mode
+{
+    atr_load_copy, // Read full image into memory
+    atr_load_map,  // Map the file read-only, sector data points into the mapping
+    atr_load_lazy, // Read sectors on demand into a small sector cache
+    atr_load_write // Allow modifications, written back with atr_commit()
+};
+
+struct atr_lazy;
+struct atr_write;
 
 struct atr_image
 {
     const uint8_t *data;
     unsigned sec_size;
     unsigned sec_count;
+    // Private to atr.c
+    unsigned pad_size;      // Bytes missing from first 3 sectors in "data"
+    uint8_t *boot;          // First 3 sectors, padded, if pad_size != 0
+    void *map;              // File mapping, if any
+    size_t map_size;
+    struct atr_lazy *lazy;  // Sector cache, if reading on demand
+    uint8_t *range;         // Buffer for atr_data_range()
+    size_t range_size;
+    struct atr_write *write; // Modified sectors, if writable
 };
 
+// Geometry of an image file
+struct atr_geometry
+{
+    unsigned sec_size;
+    unsigned sec_count;
+    unsigned pad_size; // Bytes missing from first 3 sectors in the file
+    size_t offset;     // File offset of first sector, 0 without header
+    unsigned size;     // Image size in the header
+    int rounded;       // The size in the header is invalid, rounded down
+};
+
+// Result of atr_parse_header()
+enum atr_header
+{
+    atr_header_ok,
+    atr_header_raw,         // No header, and the file size is not of a raw image
+    atr_header_sector_size, // Unsupported sector size
+    atr_header_too_small    // Image size too small
+};
+
+// Gets the geometry from the first 16 bytes of a file of "fsize" bytes, or -1
+// if not known. The file size is only used for raw images without header.
+enum atr_header atr_parse_header(const uint8_t *hdr, off_t fsize, struct atr_geometry *geo);
+
+// Loads the image, mapping the file if possible. The returned image must not be
+// used after the file is overwritten, use atr_load_copy for that.
 struct atr_image *load_atr_image(const char *file_name);
+struct atr_image *atr_open(const char *file_name, enum atr_mode mode);
 void atr_free(struct atr_image *atr);
+// Returns an image reading sectors on demand from an open file with the given
+// geometry. Images that need fixing, like atr_open() does, are read into memory
+// instead. The image owns "fd" and closes it on atr_free(). Returns 0 if
+// reading on demand is not supported.
+struct atr_image *atr_lazy_fd(int fd, const struct atr_geometry *geo);
+// Returns the data of one sector. With atr_load_lazy, the pointer is valid only
+// until ATR_CACHE_SECTORS other sectors are accessed.
 const uint8_t *atr_data(const struct atr_image *atr, unsigned sector);
+// Returns the data of "count" consecutive sectors in one buffer, valid until the
+// next call.
+const uint8_t *atr_data_range(struct atr_image *atr, unsigned sector, unsigned count);
+
+// Returns the data of one sector for modification, marking the sector as
+// modified. Only for images opened with atr_load_write.
+uint8_t *atr_data_rw(struct atr_image *atr, unsigned sector);
+// Grows a writable image to "sec_count" sectors, the new sectors are zero.
+// Returns 0 on success, or -1 if the image has no ATR header or has 256 byte
+// sectors with full size boot sectors.
+int atr_resize(struct atr_image *atr, unsigned sec_count);
+// Writes the modified sectors, and the new size if changed, to the image file,
+// and flushes the file to disk. Returns 0 on success.
+int atr_commit(struct atr_image *atr);
+// Makes atr_commit() write the sector in the given pass, 0 by default. Passes
+// are written in order, flushing the file to disk after each one.
+void atr_commit_pass(struct atr_image *atr, unsigned sector, unsigned pass);
+
+// Number of sectors kept in memory by atr_load_lazy
+#define ATR_CACHE_SECTORS 256
@@ -23,8 +23,9 @@
 #include "convert.h"
 #include "flist.h"
 #include "lssfs.h"
+#include "modatr.h"
 #include "msg.h"
-#include "spartafs.h"
+#include "sfsdir.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -33,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 //---------------------------------------------------------------------
@@ -66,729 +68,421 @@ static int parse_atr_path(const char *arg, char **atr_file, char **atr_path)
 }
 
 //---------------------------------------------------------------------
-// Find a file in SpartaDOS filesystem by path
-// Returns file data and size, or NULL if not found
-static struct
+// One source to copy, with an optional destination name from the manifest
+struct copy_item
 {
-    uint8_t *data;
-    unsigned size;
-    int found;
-} find_result;
+    char *src;
+    char *dst;
+};
+typedef darray(struct copy_item) copy_list;
 
-static uint16_t read16(const uint8_t *p)
+static void add_item(copy_list *items, const char *src, const char *dst)
 {
-    return p[0] | (p[1] << 8);
+    struct copy_item it = { strdup(src), dst ? strdup(dst) : 0 };
+    if( !it.src || (dst && !it.dst) )
+        memory_error();
+    darray_add(items, it);
 }
 
-static unsigned read24(const uint8_t *p)
+// Returns the next field of a manifest line, or null at the end of the line.
+// Fields are separated by spaces or tabs, and can be quoted with '"' to
+// include spaces.
+static char *manifest_field(char **line, const char *fname, unsigned num)
 {
-    return p[0] | (p[1] << 8) | (p[2] << 16);
-}
-
-static unsigned read_file_data(struct atr_image *atr, unsigned map, unsigned size, uint8_t *data)
-{
-    const uint8_t *m = atr_data(atr, map);
-    if( !m )
+    char *p = *line;
+    while( *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' )
+        p++;
+    if( !*p )
         return 0;
-
-    unsigned pos = 0;
-    unsigned visited_count = 0;
-    const unsigned max_visited = atr->sec_count;
-
-    while( m && pos < size && visited_count < max_visited )
+    char *field = p;
+    if( *p == '"' )
     {
-        visited_count++;
-        for( unsigned s = 4; s < atr->sec_size && pos < size; s += 2 )
-        {
-            unsigned sec = read16(m + s);
-            if( sec && sec >= 2 && sec <= atr->sec_count )
-            {
-                const uint8_t *sec_data = atr_data(atr, sec);
-                if( sec_data )
-                {
-                    unsigned rem = size - pos;
-                    if( rem > atr->sec_size )
-                        rem = atr->sec_size;
-                    memcpy(data + pos, sec_data, rem);
-                    pos += rem;
-                }
-            }
-        }
-        unsigned next_map = read16(m);
-        if( next_map == 0 || next_map < 2 || next_map > atr->sec_count )
-            break;
-        m = atr_data(atr, next_map);
+        field = ++p;
+        while( *p && *p != '"' )
+            p++;
+        if( !*p )
+            show_error("%s:%u: missing closing quote", fname, num);
     }
-
-    return pos;
-}
-
-static unsigned get_name(char *name, const uint8_t *data, int max, int lower_case)
-{
-    unsigned l = 0;
-    int dot = 0;
-    for( int i = 0; i < max; i++ )
+    else
     {
-        uint8_t c = data[i];
-        if( c >= 'A' && c <= 'Z' && lower_case )
-            c = c - 'A' + 'a';
-        if( c < ' ' || c == '/' || c == '.' || c == '?' || c == '\\' || c == 96 || c > 'z' )
-            c = '_';
-        else if( c == ' ' )
-            continue;
-        if( i > 7 && !dot )
-        {
-            dot = 1;
-            name[l++] = '.';
-        }
-        name[l++] = c;
+        while( *p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' )
+            p++;
     }
-    name[l] = 0;
-    return l;
+    if( *p )
+        *p++ = 0;
+    *line = p;
+    return field;
 }
 
-static void find_file_in_dir(struct atr_image *atr, unsigned map, const char *search_path,
-                             const char *current_path)
+// Reads a manifest with one source per line, optionally followed by the
+// destination name. Empty lines and lines starting with '#' are skipped.
+static void read_manifest(const char *fname, copy_list *items)
 {
-    if( find_result.found )
-        return;
-
-    uint8_t *data = check_malloc(65536);
-    unsigned len = read_file_data(atr, map, 65536, data);
-    if( !len )
-    {
-        free(data);
-        return;
-    }
-
-    // Split search_path into current component and rest
-    const char *next_slash = strchr(search_path, '/');
-    size_t component_len = next_slash ? (next_slash - search_path) : strlen(search_path);
-    char search_component[32];
-    if( component_len >= sizeof(search_component) )
-        component_len = sizeof(search_component) - 1;
-    memcpy(search_component, search_path, component_len);
-    search_component[component_len] = '\0';
-
-    // Convert to uppercase for comparison
-    for( size_t i = 0; i < component_len; i++ )
-    {
-        if( search_component[i] >= 'a' && search_component[i] <= 'z' )
-            search_component[i] = search_component[i] - 'a' + 'A';
-    }
-
-    // Traverse directory
-    for( unsigned i = 23; i < len; i += 23 )
-    {
-        unsigned flags = data[i];
-        if( !flags )
-            break;
-        if( 0 == (flags & 0x08) )
-            continue; // unused
-        if( 0x10 == (flags & 0x10) )
-            continue; // erased
-
-        int is_dir = flags & 0x20;
-        unsigned fmap = read16(data + i + 1);
-        unsigned fsize = read24(data + i + 3);
-
-        char fname[32];
-        if( !get_name(fname, data + i + 6, 11, 0) || !*fname )
+    FILE *f = fopen(fname, "r");
+    if( !f )
+        show_error("can't open manifest '%s': %s", fname, strerror(errno));
+    char line[2 * PATH_MAX];
+    for( unsigned num = 1; fgets(line, sizeof(line), f); num++ )
+    {
+        // A full buffer without the newline is valid only at the end of file
+        size_t len = strlen(line);
+        if( len == sizeof(line) - 1 && line[len - 1] != '\n' && fgetc(f) != EOF )
+            show_error("%s:%u: line too long", fname, num);
+        char *p = line + strspn(line, " \t");
+        if( *p == '#' )
             continue;
-
-        // Convert filename to uppercase for comparison
-        char fname_upper[32];
-        strcpy(fname_upper, fname);
-        for( size_t j = 0; fname_upper[j]; j++ )
-        {
-            if( fname_upper[j] >= 'a' && fname_upper[j] <= 'z' )
-                fname_upper[j] = fname_upper[j] - 'a' + 'A';
-        }
-
-        // Check if this matches our search component
-        if( strcmp(fname_upper, search_component) == 0 )
-        {
-            if( is_dir )
-            {
-                // Recurse into subdirectory
-                if( next_slash )
-                {
-                    char *new_path;
-                    int ret = asprintf(&new_path, "%s/%s", current_path, fname);
-                    if( ret >= 0 )
-                    {
-                        find_file_in_dir(atr, fmap, next_slash + 1, new_path);
-                        free(new_path);
-                    }
-                }
-            }
-            else
-            {
-                // Found the file!
-                if( !next_slash ) // Must be at end of path
-                {
-                    find_result.size = fsize;
-                    find_result.data = check_malloc(fsize);
-                    unsigned r = read_file_data(atr, fmap, fsize, find_result.data);
-                    if( r != fsize )
-                        show_msg("short file read: expected %u, got %u", fsize, r);
-                    find_result.found = 1;
-                }
-            }
-            break;
-        }
-    }
-
-    free(data);
+        char *src = manifest_field(&p, fname, num);
+        if( !src )
+            continue;
+        char *dst = manifest_field(&p, fname, num);
+        if( manifest_field(&p, fname, num) )
+            show_error("%s:%u: expected source and optional destination", fname, num);
+        if( dst && has_wildcards(src) )
+            show_error("%s:%u: can't rename the files matching '%s'", fname, num, src);
+        add_item(items, src, dst);
+    }
+    fclose(f);
 }
 
-static int extract_from_atr(const char *atr_file, const char *atr_path, const char *output_file,
-                             int to_utf8, int sevenbit)
+static void free_items(copy_list *items)
 {
-    struct atr_image *atr = load_atr_image(atr_file);
-    if( !atr )
-        return 1;
-
-    // Check if it's a SpartaDOS filesystem
-    const uint8_t *boot = atr_data(atr, 1);
-    if( !boot || boot[7] != 0x80 )
+    struct copy_item *it;
+    darray_foreach(it, items)
     {
-        show_error("%s: only SpartaDOS/BW-DOS images are supported for file extraction",
-                   atr_file);
-        atr_free(atr);
-        return 1;
+        free(it->src);
+        free(it->dst);
     }
+    darray_delete(*items);
+}
 
-    // Find root directory (sector 361 for SpartaDOS)
-    unsigned root_map = read16(boot + 0x0A);
-
-    // Initialize find result
-    find_result.data = NULL;
-    find_result.size = 0;
-    find_result.found = 0;
-
-    // Find the file
-    find_file_in_dir(atr, root_map, atr_path, "");
-
-    if( !find_result.found )
-    {
-        show_error("%s: file '%s' not found in ATR image", atr_file, atr_path);
-        atr_free(atr);
-        return 1;
-    }
+// Extracts one file to the host, converting if requested. Without conversion
+// the data is written directly from the image.
+static void extract_file(struct atr_image *atr, unsigned map, unsigned size,
+                         const char *output_file, int to_utf8, int sevenbit)
+{
+    int fd = creat(output_file, 0666);
+    if( fd == -1 )
+        show_error("can't create output file '%s': %s", output_file, strerror(errno));
 
-    // Convert if requested
-    uint8_t *output_data = find_result.data;
-    size_t output_size = find_result.size;
+    unsigned r;
     if( to_utf8 )
     {
+        uint8_t *data = check_malloc(size ? size : 1);
+        r = sfs_read_file(atr, map, size, data);
         uint8_t *converted = NULL;
         size_t converted_size = 0;
-        if( convert_buffer_atascii_to_utf8(find_result.data, find_result.size,
-                                             &converted, &converted_size, sevenbit) != 0 )
-        {
+        if( convert_buffer_atascii_to_utf8(data, r, &converted, &converted_size, sevenbit) != 0 )
             show_error("conversion failed");
-            free(find_result.data);
-            atr_free(atr);
-            return 1;
-        }
-        free(find_result.data);
-        output_data = converted;
-        output_size = converted_size;
-    }
-
-    // Write to output file
-    int fd = creat(output_file, 0666);
-    if( fd == -1 )
-    {
-        show_error("can't create output file '%s': %s", output_file, strerror(errno));
-        free(output_data);
-        atr_free(atr);
-        return 1;
+        if( converted_size != write(fd, converted, converted_size) )
+            show_error("can't write output file '%s': %s", output_file, strerror(errno));
+        free(converted);
+        free(data);
     }
-
-    if( output_size != write(fd, output_data, output_size) )
-    {
+    else if( sfs_write_file(atr, map, size, fd, &r) )
+        show_error("can't write output file '%s': %s", output_file, strerror(errno));
+    if( r != size )
+        show_msg("short file read: expected %u, got %u", size, r);
+    if( close(fd) )
         show_error("can't write output file '%s': %s", output_file, strerror(errno));
-        close(fd);
-        free(output_data);
-        atr_free(atr);
-        return 1;
-    }
-
-    close(fd);
-    free(output_data);
-    atr_free(atr);
-
-    show_msg("extracted '%s' from '%s' to '%s'", atr_path, atr_file, output_file);
-    return 0;
 }
 
-//---------------------------------------------------------------------
-// Read all files from ATR and extract to temp directory, then add to file_list
-static void extract_all_to_temp(struct atr_image *atr, unsigned map, const char *temp_dir,
-                                const char *dir_path)
+// Extracts the entry to the "dest" file if "single" is set, else to the
+// "dest" directory with the given name or the name in the image.
+static void extract_entry(struct atr_image *atr, const struct sfs_entry *e, const char *name,
+                          const char *dest, int single, int to_utf8, int sevenbit)
 {
-    uint8_t *data = check_malloc(65536);
-    unsigned len = read_file_data(atr, map, 65536, data);
-    if( !len )
-    {
-        free(data);
-        return;
-    }
-
-    for( unsigned i = 23; i < len; i += 23 )
-    {
-        unsigned flags = data[i];
-        if( !flags )
-            break;
-        if( 0 == (flags & 0x08) )
-            continue; // unused
-        if( 0x10 == (flags & 0x10) )
-            continue; // erased
-
-        int is_dir = flags & 0x20;
-        unsigned fmap = read16(data + i + 1);
-        unsigned fsize = read24(data + i + 3);
-
-        char fname[32];
-        if( !get_name(fname, data + i + 6, 11, 0) || !*fname )
-            continue;
+    char out[PATH_MAX];
+    if( single )
+        snprintf(out, sizeof(out), "%s", dest);
+    else if( !sanitize_path_in(dest, name ? name : e->name, out, sizeof(out)) )
+        show_error("invalid output file name '%s'", name ? name : e->name);
+    extract_file(atr, e->map, e->size, out, to_utf8, sevenbit);
+}
 
-        char *full_path;
-        if( *dir_path )
-        {
-            int ret = asprintf(&full_path, "%s/%s", dir_path, fname);
-            if( ret < 0 )
-            {
-                show_error("memory error allocating path name");
-                continue;
-            }
-        }
-        else
-        {
-            full_path = strdup(fname);
-            if( !full_path )
-                memory_error();
-        }
+// Extracts all the sources from the image, loading it only once. The sources
+// can have wildcards in the file name. If "single" is set, "dest" is the name
+// of the output file unless it is a directory, else the files are written to
+// the "dest" directory.
+static int extract_from_atr(const char *atr_file, copy_list *items, const char *dest,
+                            int single, int to_utf8, int sevenbit)
+{
+    struct atr_image *atr = load_atr_image(atr_file);
+    if( !atr )
+        return 1;
 
-        char *host_path;
-        int ret = asprintf(&host_path, "%s/%s", temp_dir, full_path);
-        if( ret < 0 )
-        {
-            show_error("memory error");
-            free(full_path);
-            continue;
-        }
+    // Read all the directories once
+    struct sfs_index *idx = sfs_index_load(atr);
+    if( !idx )
+        show_error("%s: only SpartaDOS/BW-DOS images are supported for file extraction",
+                   atr_file);
 
-        if( is_dir )
+    struct stat st;
+    if( single && !stat(dest, &st) && S_ISDIR(st.st_mode) )
+        single = 0;
+    else if( !single && stat(dest, &st) && compat_mkdir(dest) )
+        show_error("can't create output directory '%s': %s", dest, strerror(errno));
+
+    unsigned count = 0;
+    struct copy_item *it;
+    darray_foreach(it, items)
+    {
+        char *file = NULL, *path = NULL;
+        if( !parse_atr_path(it->src, &file, &path) || strcmp(file, atr_file) )
+            show_error("all sources must be files in '%s', not '%s'", atr_file, it->src);
+        if( !path )
+            show_error("source ATR path cannot be empty");
+
+        // Without wildcards, get the file directly, else extract all the
+        // matching files in the directory
+        const struct sfs_entry *e;
+        unsigned found = 0;
+        if( !has_wildcards(path) )
         {
-            // Create directory
-            compat_mkdir(host_path);
-            // Recurse into subdirectory
-            extract_all_to_temp(atr, fmap, temp_dir, full_path);
-            free(host_path);
-            free(full_path);
+            if( !(e = sfs_index_find(idx, path)) )
+                show_error("file '%s' not found in ATR image", it->src);
+            if( e->flags & 0x20 )
+                show_error("'%s' is a directory", it->src);
+            extract_entry(atr, e, it->dst, dest, single, to_utf8, sevenbit);
+            found = 1;
         }
         else
         {
-            // Read file data and write to temp directory
-            uint8_t *fdata = check_malloc(fsize);
-            unsigned r = read_file_data(atr, fmap, fsize, fdata);
-            if( r != fsize )
-                show_msg("%s: short file read", full_path);
-
-            // Create parent directory if needed
-            char *parent_dir = strdup(host_path);
-            char *last_slash = strrchr(parent_dir, '/');
-            if( last_slash )
-            {
-                *last_slash = '\0';
-                compat_mkdir(parent_dir);
-            }
-            free(parent_dir);
-
-            // Write file
-            FILE *tmp = fopen(host_path, "wb");
-            if( tmp )
-            {
-                fwrite(fdata, 1, fsize, tmp);
-                fclose(tmp);
-            }
+            char *name = strrchr(path, '/');
+            if( name )
+                *name++ = 0;
             else
+                name = path;
+            const char *dname = name == path ? "" : path;
+            if( has_wildcards(dname) )
+                show_error("%s: wildcards are only allowed in file names", it->src);
+            const struct sfs_entry *dir = sfs_index_find(idx, dname);
+            if( !dir || !(dir->flags & 0x20) )
+                show_error("%s: directory '%s' not found in ATR image", atr_file, dname);
+            for( e = dir->child; e; e = e->next )
             {
-                show_msg("warning: can't create temp file for %s", host_path);
+                if( !(e->flags & 0x20) && wildcard_match(name, e->name, 1) )
+                {
+                    extract_entry(atr, e, 0, dest, 0, to_utf8, sevenbit);
+                    found++;
+                }
             }
-
-            free(fdata);
-            free(host_path);
-            free(full_path);
+            if( !found )
+                show_error("no files match '%s' in ATR image", it->src);
         }
+        count += found;
+        free(file);
+        free(path);
     }
+    sfs_index_free(idx);
+    atr_free(atr);
 
-    free(data);
+    show_msg("extracted %u files from '%s'", count, atr_file);
+    return 0;
 }
 
 //---------------------------------------------------------------------
-// Recursively add all files from a directory to file_list
-// Adds directories first, then files, to ensure proper hierarchy
-static void add_dir_to_flist(file_list *flist, const char *dir_path)
+// Reads the whole input file, also from pipes
+static char *read_input(const char *input_file, size_t *size)
 {
-    DIR *dir = opendir(dir_path);
-    if( !dir )
-        return;
-
-    // Collect all entries first
-    struct dirent **entries = NULL;
-    int count = 0;
-    struct dirent *entry;
-    while( (entry = readdir(dir)) != NULL )
-    {
-        if( entry->d_name[0] == '.' && (entry->d_name[1] == '\0' ||
-                                         (entry->d_name[1] == '.' && entry->d_name[2] == '\0')) )
-            continue; // Skip . and ..
-
-        // Allocate space for entry pointer
-        entries = check_realloc(entries, (count + 1) * sizeof(struct dirent *));
-        // Allocate space for the dirent structure
-        entries[count] = check_malloc(entry->d_reclen);
-        memcpy(entries[count], entry, entry->d_reclen);
-        count++;
-    }
-    closedir(dir);
-
-    // First pass: add directories
-    for( int i = 0; i < count; i++ )
-    {
-        entry = entries[i];
-        char *full_path;
-        int ret = asprintf(&full_path, "%s/%s", dir_path, entry->d_name);
-        if( ret < 0 )
-        {
-            show_error("memory error");
-            continue;
-        }
-
-        struct stat st;
-        if( stat(full_path, &st) == 0 && S_ISDIR(st.st_mode) )
-        {
-            // Add directory first
-            flist_add_file(flist, full_path, 0, 0);
-            // Then recurse into it
-            add_dir_to_flist(flist, full_path);
-        }
-
-        free(full_path);
-    }
-
-    // Second pass: add files
-    for( int i = 0; i < count; i++ )
-    {
-        entry = entries[i];
-        char *full_path;
-        int ret = asprintf(&full_path, "%s/%s", dir_path, entry->d_name);
-        if( ret < 0 )
-        {
-            show_error("memory error");
-            continue;
-        }
-
-        struct stat st;
-        if( stat(full_path, &st) == 0 && S_ISREG(st.st_mode) )
-        {
-            // Add file to list
-            flist_add_file(flist, full_path, 0, 0);
-        }
-
-        free(full_path);
-    }
-
-    // Free entries
-    for( int i = 0; i < count; i++ )
-        free(entries[i]);
-    free(entries);
+    FILE *in = fopen(input_file, "rb");
+    if( !in )
+        show_error("can't open input file '%s': %s", input_file, strerror(errno));
+    size_t len = 0, alloc = 4096;
+    char *data = check_malloc(alloc);
+    while( (len += fread(data + len, 1, alloc - len, in)) == alloc )
+    {
+        alloc *= 2;
+        data = check_realloc(data, alloc);
+    }
+    if( ferror(in) )
+        show_error("error reading input file '%s': %s", input_file, strerror(errno));
+    fclose(in);
+    *size = len;
+    return data;
 }
 
-static int add_to_atr(const char *input_file, const char *atr_file, const char *atr_path,
-                       int to_atascii)
+// Adds the directories in the path, returns the last one and sets "path" to
+// the last part of the path.
+static struct afile *add_path_dirs(file_list *flist, struct afile *dir, const char **path)
 {
-    // Load existing ATR
-    struct atr_image *atr = load_atr_image(atr_file);
-    if( !atr )
-        return 1;
-
-    // Check if it's a SpartaDOS filesystem
-    const uint8_t *boot = atr_data(atr, 1);
-    if( !boot || boot[7] != 0x80 )
-    {
-        show_error("%s: only SpartaDOS/BW-DOS images can be modified", atr_file);
-        atr_free(atr);
-        return 1;
-    }
-
-    // Create backup
-    char *backup_file = check_malloc(strlen(atr_file) + 10);
-    strcpy(backup_file, atr_file);
-    strcat(backup_file, ".bak");
-
-    FILE *src = fopen(atr_file, "rb");
-    if( !src )
-    {
-        show_error("can't open '%s' for reading: %s", atr_file, strerror(errno));
-        free(backup_file);
-        atr_free(atr);
-        return 1;
-    }
-
-    FILE *dst = fopen(backup_file, "wb");
-    if( !dst )
-    {
-        show_error("can't create backup '%s': %s", backup_file, strerror(errno));
-        fclose(src);
-        free(backup_file);
-        atr_free(atr);
-        return 1;
-    }
-
-    uint8_t buffer[4096];
-    size_t n;
-    while( (n = fread(buffer, 1, sizeof(buffer), src)) > 0 )
+    const char *sep;
+    while( (sep = strchr(*path, '/')) != NULL )
     {
-        if( fwrite(buffer, 1, n, dst) != n )
+        if( sep > *path )
         {
-            show_error("error writing backup file");
-            fclose(src);
-            fclose(dst);
-            unlink(backup_file);
-            free(backup_file);
-            atr_free(atr);
-            return 1;
+            char *name = check_malloc(sep - *path + 1);
+            memcpy(name, *path, sep - *path);
+            name[sep - *path] = '\0';
+            dir = flist_add_dir(flist, dir, name);
+            free(name);
         }
+        *path = sep + 1;
     }
-    fclose(src);
-    fclose(dst);
-
-    show_msg("Backup created: %s", backup_file);
-    free(backup_file);
-
-    // Create temporary directory for extracted files
-    char *temp_dir;
-    int ret = asprintf(&temp_dir, "/tmp/atrcp_%d_%p", getpid(), (void *)atr);
-    if( ret < 0 )
-    {
-        show_error("memory error");
-        atr_free(atr);
-        return 1;
-    }
-
-    if( compat_mkdir(temp_dir) )
-    {
-        show_error("can't create temp directory '%s': %s", temp_dir, strerror(errno));
-        free(temp_dir);
-        atr_free(atr);
-        return 1;
-    }
-
-    // Save ATR parameters before freeing
-    unsigned old_sec_size = atr->sec_size;
-    unsigned old_sec_count = atr->sec_count;
-
-    // Extract all files to temp directory
-    unsigned root_map = read16(boot + 0x0A);
-    extract_all_to_temp(atr, root_map, temp_dir, "");
-
-    atr_free(atr); // No longer need the ATR in memory
-
-    // Read all existing files into file_list
-    file_list flist;
-    darray_init(flist, 1);
-    flist_add_main_dir(&flist);
-
-    // Add all files from temp directory to file_list
-    add_dir_to_flist(&flist, temp_dir);
+    return dir;
+}
 
-    // Handle the new file - convert if needed
-    const char *file_to_add = input_file;
-    char *temp_converted_file = NULL;
+// Adds the input file to the file list as "name" inside "dir"
+static void add_input(file_list *flist, struct afile *dir, const char *name,
+                      const char *input_file, int to_atascii)
+{
+    // Read the new file, converting in memory if requested
+    size_t size;
+    char *data = read_input(input_file, &size);
     if( to_atascii )
     {
-        // Read input file and convert
-        FILE *in = fopen(input_file, "rb");
-        if( !in )
-        {
-            show_error("can't open input file '%s': %s", input_file, strerror(errno));
-            darray_delete(flist);
-            return 1;
-        }
-
-        // Get file size
-        fseek(in, 0, SEEK_END);
-        long file_size = ftell(in);
-        fseek(in, 0, SEEK_SET);
-
-        uint8_t *input_data = check_malloc(file_size);
-        if( fread(input_data, 1, file_size, in) != file_size )
-        {
-            show_error("error reading input file");
-            fclose(in);
-            free(input_data);
-            darray_delete(flist);
-            return 1;
-        }
-        fclose(in);
-
-        // Convert
         uint8_t *converted = NULL;
         size_t converted_size = 0;
-        if( convert_buffer_utf8_to_atascii(input_data, file_size, &converted, &converted_size) != 0 )
-        {
+        if( convert_buffer_utf8_to_atascii((uint8_t *)data, size, &converted,
+                                           &converted_size) != 0 )
             show_error("conversion failed");
-            free(input_data);
-            darray_delete(flist);
-            return 1;
-        }
-        free(input_data);
+        free(data);
+        data = (char *)converted;
+        size = converted_size;
+    }
 
-        // Write to temp file
-        int ret = asprintf(&temp_converted_file, "/tmp/atrcp_conv_%d_%p", getpid(), (void *)&flist);
-        if( ret < 0 )
-        {
-            show_error("memory error");
-            free(converted);
-            darray_delete(flist);
-            return 1;
-        }
+    dir = add_path_dirs(flist, dir, &name);
+    struct afile *f = flist_add_data(flist, dir, *name ? name : input_file, data, size, 0);
 
-        FILE *out = fopen(temp_converted_file, "wb");
-        if( !out )
-        {
-            show_error("can't create temp file '%s': %s", temp_converted_file, strerror(errno));
-            free(converted);
-            free(temp_converted_file);
-            darray_delete(flist);
-            return 1;
-        }
+    // Keep the date of the input file
+    struct stat st;
+    if( !stat(input_file, &st) )
+        flist_set_time(f, st.st_mtime);
+}
 
-        if( fwrite(converted, 1, converted_size, out) != converted_size )
-        {
-            show_error("error writing temp file");
-            fclose(out);
-            free(converted);
-            free(temp_converted_file);
-            darray_delete(flist);
-            return 1;
-        }
-        fclose(out);
-        free(converted);
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-        file_to_add = temp_converted_file;
+// Adds all the host files matching the wildcards in the file name, sorted
+static void add_matching(file_list *flist, struct afile *dir, const char *pattern,
+                         int to_atascii)
+{
+    // Split the directory part, the wildcards are only in the file name
+    const char *base = pattern;
+    for( const char *p = pattern; *p; p++ )
+        if( is_separator(*p) )
+            base = p + 1;
+    char *dname = check_malloc(base - pattern + 2);
+    memcpy(dname, pattern, base - pattern);
+    strcpy(dname + (base - pattern), base == pattern ? "." : "");
+    if( has_wildcards(dname) )
+        show_error("wildcards are only allowed in file names: '%s'", pattern);
+
+    DIR *d = opendir(dname);
+    if( !d )
+        show_error("can't open directory '%s': %s", dname, strerror(errno));
+    darray(char *) names;
+    darray_init(names, 1);
+    struct dirent *ent;
+    while( (ent = readdir(d)) != NULL )
+    {
+        // Hidden files only match if asked for
+        if( (ent->d_name[0] == '.' && *base != '.') || !wildcard_match(base, ent->d_name, 0) )
+            continue;
+        char *fname = check_malloc(strlen(pattern) + strlen(ent->d_name) + 1);
+        memcpy(fname, pattern, base - pattern);
+        strcpy(fname + (base - pattern), ent->d_name);
+        struct stat st;
+        if( !stat(fname, &st) && S_ISREG(st.st_mode) )
+            darray_add(&names, fname);
+        else
+            free(fname);
     }
+    closedir(d);
+    if( !darray_len(&names) )
+        show_error("no files match '%s'", pattern);
 
-    // Add the new file
-    flist_add_file(&flist, file_to_add, 0, 0);
-
-    // Cleanup temp directory (files have been read into memory)
-    // Note: We could clean up here, but it's safer to leave it for debugging
-    // In production, we'd want to recursively remove the temp directory
-
-    // Rebuild filesystem
-    unsigned boot_addr = 0x07; // Standard boot address
-    struct sfs *sfs = build_spartafs(old_sec_size, old_sec_count, boot_addr, &flist);
-    if( !sfs )
+    qsort(names.data, darray_len(&names), sizeof(char *), cmp_names);
+    char **fname;
+    darray_foreach(fname, &names)
     {
-        show_error("can't rebuild filesystem");
-        darray_delete(flist);
-        atr_free(atr);
-        return 1;
+        add_input(flist, dir, "", *fname, to_atascii);
+        free(*fname);
     }
+    darray_delete(names);
+    free(dname);
+}
 
-    // Write new ATR
-    int nsec = sfs_get_num_sectors(sfs);
-    int ssec = sfs_get_sector_size(sfs);
-    const uint8_t *sfs_data = sfs_get_data(sfs);
+// Adds all the sources to the image in place, with one load and one write of
+// the image. The files and the directories in the paths are added to a file
+// list in memory, and written to the free sectors of the image replacing any
+// file with the same name. If "single" is set, "atr_path" is the name of the
+// file, else the files are added to the "atr_path" directory.
+static int add_to_atr(copy_list *items, const char *atr_file, const char *atr_path, int single,
+                      int to_atascii)
+{
+    file_list flist;
+    darray_init(flist, 1);
+    flist_add_main_dir(&flist);
 
-    // Calculate image size
-    int size;
-    if( nsec > 3 )
-    {
-        size = ssec * (nsec - 3) + 128 * 3;
-    }
+    const char *path = atr_path ? atr_path : "";
+    if( single )
+        add_input(&flist, NULL, path, darray_i(items, 0).src, to_atascii);
     else
     {
-        size = 128 * nsec;
-    }
+        // Add the destination directory
+        struct afile *dir = add_path_dirs(&flist, NULL, &path);
+        if( *path )
+            dir = flist_add_dir(&flist, dir, path);
 
-    FILE *out = fopen(atr_file, "wb");
-    if( !out )
-    {
-        show_error("can't open '%s' for writing: %s", atr_file, strerror(errno));
-        sfs_free(sfs);
-        darray_delete(flist);
-        atr_free(atr);
-        return 1;
-    }
-
-    // Write ATR header
-    putc(0x96, out);
-    putc(0x02, out);
-    putc(size >> 4, out);
-    putc(size >> 12, out);
-    putc(ssec, out);
-    putc(ssec >> 8, out);
-    putc(size >> 20, out);
-    for( int i = 0; i < 9; i++ )
-        putc(0, out);
-
-    // Write sectors
-    for( int i = 0; i < nsec; i++ )
-    {
-        size_t write_size = (i < 3) ? 128 : ssec;
-        if( fwrite(sfs_data + ssec * i, write_size, 1, out) != 1 )
+        struct copy_item *it;
+        darray_foreach(it, items)
         {
-            show_error("can't write sector %d: %s", i + 1, strerror(errno));
-            fclose(out);
-            sfs_free(sfs);
-            darray_delete(flist);
-            atr_free(atr);
-            return 1;
+            if( has_wildcards(it->src) )
+                add_matching(&flist, dir, it->src, to_atascii);
+            else
+                add_input(&flist, dir, it->dst ? it->dst : "", it->src, to_atascii);
         }
     }
 
-    fclose(out);
-    sfs_free(sfs);
-    darray_delete(flist);
-    if( temp_converted_file )
-    {
-        unlink(temp_converted_file);
-        free(temp_converted_file);
-    }
-
-    show_msg("added '%s' to '%s'", input_file, atr_file);
-    return 0;
+    // Add all but the main directory
+    file_list new_files;
+    darray_init(new_files, 1);
+    for( unsigned i = 1; i < darray_len(&flist); i++ )
+        darray_add(&new_files, darray_i(&flist, i));
+    modatr_set_replace(1);
+    int ret = modatr_add_files(atr_file, &new_files);
+    darray_delete(new_files);
+    flist_free(&flist);
+    return ret;
 }
 
 //---------------------------------------------------------------------
 static void show_usage(void)
 {
-    printf("Usage: %s [options] <source> <destination>\n"
+    printf("Usage: %s [options] <source>... <destination>\n"
            "\n"
            "Copy files between ATR images and the host filesystem.\n"
            "\n"
            "Extract from ATR:\n"
            "  %s image.atr:path/to/file.ext output.ext\n"
-           "  %s image.atr:file.ext .\n"
+           "  %s image.atr:file.ext image.atr:'*.COM' outdir\n"
            "\n"
            "Add to ATR:\n"
            "  %s input.ext image.atr:path/to/file.ext\n"
-           "  %s input.ext image.atr:\n"
+           "  %s input.ext 'build/*.com' image.atr:path/to/dir\n"
+           "\n"
+           "Rename or move inside an ATR:\n"
+           "  %s image.atr:old.ext image.atr:dir/new.ext\n"
+           "\n"
+           "Delete from ATR:\n"
+           "  %s --delete image.atr:path/to/file.ext\n"
+           "\n"
+           "With many sources, wildcards or a manifest, the destination is a\n"
+           "directory and the image is read and written only once.\n"
            "\n"
            "Options:\n"
            "  --to-utf8\tConvert ATASCII to UTF8 when extracting from ATR.\n"
            "  --to-atascii\tConvert UTF8 to ATASCII when adding to ATR.\n"
            "  --7bit\tUse 7-bit mode for ATASCII→UTF8 conversion (strip high bit).\n"
+           "  --delete\tDelete the file or empty directory from the ATR.\n"
+           "  --manifest file\n"
+           "\t\tRead more sources from the file, one per line, each one\n"
+           "\t\toptionally followed by the destination name.\n"
            "  -h\t\tShow this help.\n"
            "  -v\t\tShow version information.\n",
-           prog_name, prog_name, prog_name, prog_name, prog_name);
+           prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
     exit(EXIT_SUCCESS);
 }
 
@@ -803,8 +497,11 @@ int main(int argc, char **argv)
     int to_utf8 = 0;
     int to_atascii = 0;
     int sevenbit = 0;
-    const char *source = NULL;
+    int delete = 0;
+    const char *manifest = NULL;
     const char *dest = NULL;
+    copy_list items;
+    darray_init(items, 1);
 
     for( int i = 1; i < argc; i++ )
     {
@@ -821,25 +518,61 @@ int main(int argc, char **argv)
             to_atascii = 1;
         else if( !strcmp(argv[i], "--7bit") )
             sevenbit = 1;
-        else if( !source )
-            source = argv[i];
-        else if( !dest )
-            dest = argv[i];
+        else if( !strcmp(argv[i], "--sparse") )
+            show_opt_error("option '--sparse' not supported, files are added in place");
+        else if( !strcmp(argv[i], "--delete") )
+            delete = 1;
+        else if( !strcmp(argv[i], "--manifest") )
+        {
+            if( i + 1 >= argc )
+                show_opt_error("option '--manifest' needs a file name");
+            if( manifest )
+                show_opt_error("only one manifest file allowed");
+            manifest = argv[++i];
+        }
         else
-            show_opt_error("too many arguments");
+        {
+            // The last argument is the destination, the others are sources
+            if( dest )
+                add_item(&items, dest, NULL);
+            dest = argv[i];
+        }
+    }
+
+    if( delete )
+    {
+        char *atr_file = NULL, *atr_path = NULL;
+        if( !dest || darray_len(&items) || manifest )
+            show_opt_error("--delete expects one ATR path");
+        if( !parse_atr_path(dest, &atr_file, &atr_path) || !atr_path )
+            show_opt_error("--delete expects an ATR path, like image.atr:file.ext");
+        int ret = modatr_delete_file(atr_file, atr_path);
+        free(atr_file);
+        free(atr_path);
+        free_items(&items);
+        return ret;
     }
 
-    if( !source || !dest )
+    // The manifest adds more sources
+    if( !dest || (!manifest && !darray_len(&items)) )
         show_opt_error("expected source and destination arguments");
+    if( manifest )
+        read_manifest(manifest, &items);
+    if( !darray_len(&items) )
+        show_error("%s: no sources in manifest", manifest);
 
     if( to_utf8 && to_atascii )
         show_opt_error("cannot specify both --to-utf8 and --to-atascii");
 
+    // A single source with no wildcards keeps the destination as a file name
+    struct copy_item *first = &darray_i(&items, 0);
+    int single = darray_len(&items) == 1 && !manifest && !has_wildcards(first->src);
+
     // Parse source and destination to determine operation
     char *src_atr_file = NULL, *src_atr_path = NULL;
     char *dst_atr_file = NULL, *dst_atr_path = NULL;
 
-    int src_is_atr = parse_atr_path(source, &src_atr_file, &src_atr_path);
+    int src_is_atr = parse_atr_path(first->src, &src_atr_file, &src_atr_path);
     int dst_is_atr = parse_atr_path(dest, &dst_atr_file, &dst_atr_path);
 
     int ret = 1;
@@ -847,18 +580,33 @@ int main(int argc, char **argv)
     if( src_is_atr && !dst_is_atr )
     {
         // Extract from ATR
-        if( !src_atr_path )
-            show_opt_error("source ATR path cannot be empty");
         if( to_atascii )
             show_opt_error("--to-atascii can only be used when adding files to ATR");
-        ret = extract_from_atr(src_atr_file, src_atr_path, dest, to_utf8, sevenbit);
+        ret = extract_from_atr(src_atr_file, &items, dest, single, to_utf8, sevenbit);
     }
     else if( !src_is_atr && dst_is_atr )
     {
-        // Add to ATR
+        // Add to ATR, all the sources must be host files
+        struct copy_item *it;
+        darray_foreach(it, &items)
+        {
+            if( strchr(it->src, ':') )
+                show_opt_error("can't mix ATR and host sources: '%s'", it->src);
+        }
         if( to_utf8 )
             show_opt_error("--to-utf8 can only be used when extracting files from ATR");
-        ret = add_to_atr(source, dst_atr_file, dst_atr_path, to_atascii);
+        if( single && dst_atr_path && dst_atr_path[strlen(dst_atr_path) - 1] == '/' )
+            single = 0;
+        ret = add_to_atr(&items, dst_atr_file, dst_atr_path, single, to_atascii);
+    }
+    else if( src_is_atr && dst_is_atr && !strcmp(src_atr_file, dst_atr_file) )
+    {
+        // Rename inside the image
+        if( darray_len(&items) != 1 || manifest )
+            show_opt_error("only one file can be renamed at a time");
+        if( !src_atr_path )
+            show_opt_error("source ATR path cannot be empty");
+        ret = modatr_rename_file(src_atr_file, src_atr_path, dst_atr_path ? dst_atr_path : "");
     }
     else
     {
@@ -873,6 +621,7 @@ int main(int argc, char **argv)
         free(dst_atr_file);
     if( dst_atr_path )
         free(dst_atr_path);
+    free_items(&items);
 
     return ret;
 }
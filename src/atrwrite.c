@@ -0,0 +1,370 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Write ATR files.
+ */
+#define _GNU_SOURCE
+#include "atrwrite.h"
+#include "msg.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !( defined(_WIN32) || defined(__WIN32__) )
+#define ATR_POSIX_IO 1
+#include <sys/uio.h>
+#else
+#include <io.h>
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// List of buffers to write
+struct io_list
+{
+    struct iovec *iov;
+    unsigned count;
+    unsigned size;
+};
+
+// Adds a buffer to the list, joining it to the last if contiguous in memory
+static void add_io(struct io_list *l, const uint8_t *data, size_t len)
+{
+    if( l->count && (const uint8_t *)l->iov[l->count - 1].iov_base +
+                            l->iov[l->count - 1].iov_len ==
+                        data )
+    {
+        l->iov[l->count - 1].iov_len += len;
+        return;
+    }
+    if( l->count == l->size )
+    {
+        l->size = l->size ? l->size * 2 : 64;
+        l->iov  = check_realloc(l->iov, l->size * sizeof(struct iovec));
+    }
+    l->iov[l->count].iov_base = (void *)data;
+    l->iov[l->count].iov_len  = len;
+    l->count++;
+}
+
+// Writes all the buffers, returns 0 on success.
+static int write_io(int fd, struct io_list *l)
+{
+    struct iovec *iov = l->iov;
+    unsigned count    = l->count;
+    while( count )
+    {
+#ifdef ATR_POSIX_IO
+        ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+#else
+        ssize_t n = write(fd, iov->iov_base, iov->iov_len);
+#endif
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        // Skip written buffers, and adjust partially written one
+        while( count && (size_t)n >= iov->iov_len )
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if( count )
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Write empty runs of at least this many bytes as holes in sparse mode
+#define SPARSE_MIN 4096
+
+// Write sparse files
+static int sparse_output = 0;
+
+void atr_write_set_sparse(int enable)
+{
+    sparse_output = enable;
+}
+
+// Returns true if all bytes are zero, testing 128 bytes at a time
+static int is_zero(const uint8_t *p, size_t len)
+{
+    typedef uint64_t v4u64 __attribute__((vector_size(32)));
+    size_t i = 0;
+    for( ; i + 128 <= len; i += 128 )
+    {
+        v4u64 a, b, c, d;
+        memcpy(&a, p + i, 32);
+        memcpy(&b, p + i + 32, 32);
+        memcpy(&c, p + i + 64, 32);
+        memcpy(&d, p + i + 96, 32);
+        a |= b | c | d;
+        if( a[0] | a[1] | a[2] | a[3] )
+            return 0;
+    }
+    for( ; i < len; i++ )
+        if( p[i] )
+            return 0;
+    return 1;
+}
+
+// Output file, written to a temporary name and renamed over the output. Outputs
+// that are not regular files are written directly.
+struct out_file
+{
+    const char *name;
+    char *path;     // File to replace, the target of symbolic links
+    char *tmp_name; // Temporary file, null if writing directly
+    int fd;
+};
+
+// Removes the temporary file and shows the error
+static void out_error(struct out_file *out)
+{
+    int e = errno;
+    close(out->fd);
+    if( out->tmp_name )
+        unlink(out->tmp_name);
+    show_error("can't write output file '%s': %s", out->name, strerror(e));
+}
+
+// Creates a new temporary file in the same path as the output
+static void out_open(struct out_file *out, const char *file_name)
+{
+    out->name     = file_name;
+    out->path     = 0;
+    out->tmp_name = 0;
+
+    // Renaming would replace devices, pipes and broken symbolic links instead
+    // of writing to them, so write those directly
+    struct stat st;
+    int exists  = 0 == stat(file_name, &st);
+    int is_link = 0;
+#ifdef ATR_POSIX_IO
+    struct stat lst;
+    is_link = 0 == lstat(file_name, &lst) && S_ISLNK(lst.st_mode);
+#endif
+    if( (exists && !S_ISREG(st.st_mode)) || (is_link && !exists) )
+    {
+        out->fd = open(file_name, O_WRONLY | O_CREAT | O_BINARY | (exists ? 0 : O_TRUNC), 0666);
+        if( out->fd < 0 )
+            show_error("can't open output file '%s': %s", file_name, strerror(errno));
+        return;
+    }
+
+#ifdef ATR_POSIX_IO
+    // Replace the target of symbolic links, keeping the link
+    if( is_link )
+        out->path = realpath(file_name, 0);
+#endif
+    if( !out->path )
+        out->path = strdup(file_name);
+    if( !out->path )
+        memory_error();
+
+    for( unsigned i = 0; i < 100; i++ )
+    {
+        if( 0 > asprintf(&out->tmp_name, "%s.%u.%u.tmp", out->path, (unsigned)getpid(), i) )
+            memory_error();
+        out->fd = open(out->tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+        if( out->fd >= 0 )
+            break;
+        free(out->tmp_name);
+        out->tmp_name = 0;
+        if( errno != EEXIST )
+            break;
+    }
+    if( out->fd < 0 )
+        show_error("can't open output file '%s': %s", file_name, strerror(errno));
+
+#ifdef ATR_POSIX_IO
+    // Keep permissions of the file being replaced
+    if( exists )
+        fchmod(out->fd, st.st_mode & 07777);
+#endif
+}
+
+// Writes the buffers in the list and empties it
+static void out_flush(struct out_file *out, struct io_list *l)
+{
+    if( write_io(out->fd, l) )
+        out_error(out);
+    l->count = 0;
+}
+
+// Leaves a hole of "len" bytes in the output
+static void out_skip(struct out_file *out, size_t len)
+{
+    if( lseek(out->fd, len, SEEK_CUR) < 0 )
+        out_error(out);
+}
+
+// Flush file data to disk
+static int sync_file(int fd)
+{
+#ifdef ATR_POSIX_IO
+    return fsync(fd);
+#else
+    return _commit(fd);
+#endif
+}
+
+// Sets the file size, closes the temporary file and renames it to the output
+static void out_close(struct out_file *out, size_t size)
+{
+    if( !out->tmp_name )
+    {
+        // Written directly, pipes can't be synced
+        if( sync_file(out->fd) && errno != EINVAL )
+            out_error(out);
+        if( close(out->fd) )
+            show_error("can't write output file '%s': %s", out->name, strerror(errno));
+        return;
+    }
+
+    // Extend the file if it ends in a hole
+    if( ftruncate(out->fd, size) || sync_file(out->fd) )
+        out_error(out);
+    if( close(out->fd) )
+    {
+        int e = errno;
+        unlink(out->tmp_name);
+        show_error("can't write output file '%s': %s", out->name, strerror(e));
+    }
+#ifndef ATR_POSIX_IO
+    // Rename does not replace existing files
+    remove(out->path);
+#endif
+    if( rename(out->tmp_name, out->path) )
+    {
+        int e = errno;
+        unlink(out->tmp_name);
+        show_error("can't write output file '%s': %s", out->name, strerror(e));
+    }
+    free(out->tmp_name);
+
+#ifdef ATR_POSIX_IO
+    // Make the rename durable, syncing the containing directory
+    char *dir = strdup(out->path);
+    char *sep = dir ? strrchr(dir, '/') : 0;
+    if( dir )
+    {
+        if( sep )
+            sep[sep == dir] = 0;
+        int dfd = open(sep ? dir : ".", O_RDONLY);
+        if( dfd >= 0 )
+        {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+#endif
+    free(out->path);
+}
+
+void atr_write_sectors(const char *file_name, unsigned ssec, unsigned nsec,
+                       const uint8_t *const *sect)
+{
+    // Image size, first three sectors are 128 bytes
+    size_t size = nsec > 3 ? (size_t)ssec * (nsec - 3) + 128 * 3 : 128 * nsec;
+
+    uint8_t hdr[16] = { 0x96, 0x02, size >> 4, size >> 12, ssec, ssec >> 8, size >> 20 };
+
+    struct out_file out;
+    out_open(&out, file_name);
+
+    // Find empty sectors, in sparse mode also sectors with all zero data
+    int sparse     = 0;
+    uint8_t *empty = check_malloc(nsec ? nsec : 1);
+    for( unsigned i = 0; i < nsec; i++ )
+        empty[i] = !sect[i] || (sparse_output && is_zero(sect[i], i < 3 ? 128 : ssec));
+#ifdef ATR_POSIX_IO
+    // Holes are only possible in the temporary file
+    sparse = sparse_output && out.tmp_name;
+#endif
+
+    // Get buffer for the longest run of empty sectors not written as a hole
+    size_t zlen = 0;
+    for( unsigned i = 0; i < nsec; )
+    {
+        size_t len = 0;
+        for( ; i < nsec && empty[i]; i++ )
+            len += i < 3 ? 128 : ssec;
+        if( len > zlen && (!sparse || len < SPARSE_MIN) )
+            zlen = len;
+        for( ; i < nsec && !empty[i]; i++ )
+            ;
+    }
+    uint8_t *zero = zlen ? check_calloc(1, zlen) : 0;
+
+    struct io_list l = { 0 };
+    add_io(&l, hdr, sizeof(hdr));
+    for( unsigned i = 0; i < nsec; )
+    {
+        if( !empty[i] )
+        {
+            add_io(&l, sect[i], i < 3 ? 128 : ssec);
+            i++;
+            continue;
+        }
+        size_t len = 0;
+        for( ; i < nsec && empty[i]; i++ )
+            len += i < 3 ? 128 : ssec;
+        if( sparse && len >= SPARSE_MIN )
+        {
+            out_flush(&out, &l);
+            out_skip(&out, len);
+        }
+        else
+            add_io(&l, zero, len);
+    }
+    out_flush(&out, &l);
+    out_close(&out, size + sizeof(hdr));
+    free(l.iov);
+    free(zero);
+    free(empty);
+}
+void atr_write_data(const char *file_name, const uint8_t *data, unsigned ssec,
+                    unsigned nsec)
+{
+    const uint8_t **sect = check_malloc((nsec ? nsec : 1) * sizeof(uint8_t *));
+    for( unsigned i = 0; i < nsec; i++ )
+        sect[i] = data + (size_t)ssec * i;
+    atr_write_sectors(file_name, ssec, nsec, sect);
+    free(sect);
+}
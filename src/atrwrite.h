@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Write ATR files.
+ */
+#pragma once
+#include <stdint.h>
+
+// Writes an ATR image with "nsec" sectors of "ssec" bytes, the data of sector
+// "i" is at sect[i-1], or all zeros if null. The first 3 sectors are stored as
+// 128 bytes. The image is written to a temporary file that replaces the output
+// file only when complete, so the old file is never left half written.
+void atr_write_sectors(const char *file_name, unsigned ssec, unsigned nsec,
+                       const uint8_t *const *sect);
+// Same, with the data of all sectors contiguous.
+void atr_write_data(const char *file_name, const uint8_t *data, unsigned ssec,
+                    unsigned nsec);
+// Leave holes in the output for runs of zero bytes, making sparse files.
+void atr_write_set_sparse(int enable);
@@ -142,3 +142,55 @@ int sanitize_path(const char *path, char *output, size_t output_size)
     output[out_pos] = '\0';
     return 1;
 }
+
+int sanitize_path_in(const char *dir, const char *path, char *output, size_t output_size)
+{
+    if( !dir )
+        return sanitize_path(path, output, output_size);
+
+    size_t len = strlen(dir);
+    if( len + 1 >= output_size )
+        return 0;
+    memcpy(output, dir, len);
+    output[len] = '/';
+    return sanitize_path(path, output + len + 1, output_size - len - 1);
+}
+
+int has_wildcards(const char *s)
+{
+    return strchr(s, '*') || strchr(s, '?');
+}
+
+static int fold(int c, int fold_case)
+{
+    return (fold_case && c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+int wildcard_match(const char *pattern, const char *name, int fold_case)
+{
+    // Position after the last '*', to backtrack on mismatch
+    const char *star = 0, *retry = 0;
+    while( *name )
+    {
+        if( *pattern == '*' )
+        {
+            star  = ++pattern;
+            retry = name;
+        }
+        else if( *pattern == '?' || fold(*pattern, fold_case) == fold(*name, fold_case) )
+        {
+            pattern++;
+            name++;
+        }
+        else if( star )
+        {
+            pattern = star;
+            name    = ++retry;
+        }
+        else
+            return 0;
+    }
+    while( *pattern == '*' )
+        pattern++;
+    return !*pattern;
+}
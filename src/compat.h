@@ -31,3 +31,13 @@ int compat_mkdir(const char *path);
 // Returns 1 if path is safe, 0 if path contains dangerous components
 // Safe path is written to output buffer (must be at least PATH_MAX or strlen(path)+1 bytes)
 int sanitize_path(const char *path, char *output, size_t output_size);
+
+// Same as sanitize_path, but prefixes the safe path with "dir" if not null
+int sanitize_path_in(const char *dir, const char *path, char *output, size_t output_size);
+
+// Returns 1 if "s" contains the wildcards '*' or '?'
+int has_wildcards(const char *s);
+
+// Matches "name" against a "pattern" with '*' and '?' wildcards, ignoring the
+// case of ASCII letters if "fold_case" is set. Returns 1 on match.
+int wildcard_match(const char *pattern, const char *name, int fold_case);
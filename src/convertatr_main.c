@@ -17,6 +17,7 @@
 /*
  * Convert ATR images - main program.
  */
+#include "atrwrite.h"
 #include "convertatr.h"
 #include "msg.h"
 #include <stdio.h>
@@ -31,6 +32,7 @@ static void show_usage(void)
            "\t--sector-size N\tConvert to N-byte sectors (128 or 256).\n"
            "\t--convert-utf8\tConvert files from UTF8 to ATASCII when processing ATR.\n"
            "\t--convert-atascii\tConvert files from ATASCII to UTF8 when processing ATR.\n"
+           "\t--sparse\tWrite empty sectors as holes, making a sparse file.\n"
            "\t-h\t\tShow this help.\n"
            "\t-v\t\tShow version information.\n",
            prog_name);
@@ -76,6 +78,8 @@ int main(int argc, char **argv)
             convert_utf8 = 1;
         else if( !strcmp(argv[i], "--convert-atascii") )
             convert_atascii = 1;
+        else if( !strcmp(argv[i], "--sparse") )
+            atr_write_set_sparse(1);
         else if( !input_file )
             input_file = argv[i];
         else if( !output_file )
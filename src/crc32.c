@@ -19,6 +19,30 @@
  */
 
 #include "crc32.h"
+#include <string.h>
+
+#if( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#define CRC32_CLMUL 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && ( defined(__linux__) || defined(__APPLE__) )
+#define CRC32_ARMV8 1
+#include <arm_acle.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#ifdef __clang__
+#define CRC32_ARMV8_TARGET __attribute__((target("crc")))
+#else
+#define CRC32_ARMV8_TARGET __attribute__((target("+crc")))
+#endif
+#endif
+
 
 const unsigned crc_table[256] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535,
@@ -59,10 +83,214 @@ const unsigned crc_table[256] = {
     0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
     0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
 
-unsigned crc32(unsigned crc, const uint8_t *buf, unsigned len)
+// Tables for slicing-by-8, crc_slice[0] is crc_table.
+static unsigned crc_slice[8][256];
+
+static unsigned crc32_bytewise(unsigned crc, const uint8_t *buf, unsigned len)
 {
     crc = crc ^ 0xffffffffL;
     while( len-- )
         crc = crc_table[(crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
     return crc ^ 0xffffffffL;
 }
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Process 8 bytes per step, using one table lookup per byte
+static unsigned crc32_slice8(unsigned crc, const uint8_t *buf, unsigned len)
+{
+    uint32_t c = crc ^ 0xffffffffL;
+    for( ; len >= 8; len -= 8, buf += 8 )
+    {
+        uint32_t lo = get_le32(buf) ^ c;
+        uint32_t hi = get_le32(buf + 4);
+        c = crc_slice[7][lo & 0xFF] ^ crc_slice[6][(lo >> 8) & 0xFF] ^
+            crc_slice[5][(lo >> 16) & 0xFF] ^ crc_slice[4][lo >> 24] ^
+            crc_slice[3][hi & 0xFF] ^ crc_slice[2][(hi >> 8) & 0xFF] ^
+            crc_slice[1][(hi >> 16) & 0xFF] ^ crc_slice[0][hi >> 24];
+    }
+    while( len-- )
+        c = crc_table[(c ^ (*buf++)) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffL;
+}
+
+#ifdef CRC32_CLMUL
+// Folds 64 bytes per step with carry-less multiplies, then reduces to 32 bits,
+// see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ" (Intel).
+__attribute__((target("pclmul,sse4.1"))) static unsigned
+crc32_clmul(unsigned crc, const uint8_t *buf, unsigned len)
+{
+    // Constants for the bit-reflected CRC32 polynomial
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+
+    if( len < 64 )
+        return crc32_slice8(crc, buf, len);
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    unsigned rest = len & 15;
+    len -= rest;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc ^ 0xffffffffL));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // Fold four 128 bit blocks in parallel
+    for( ; len >= 64; len -= 64, buf += 64 )
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    }
+
+    // Fold into one 128 bit block
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold the remaining 128 bit blocks
+    for( ; len >= 16; len -= 16, buf += 16 )
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = _mm_extract_epi32(x1, 1) ^ 0xffffffffL;
+    return crc32_slice8(crc, buf, rest);
+}
+
+static int have_clmul(void)
+{
+    unsigned a, b, c, d;
+    if( !__get_cpuid(1, &a, &b, &c, &d) )
+        return 0;
+    return (c & bit_PCLMUL) && (c & bit_SSE4_1);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+// Uses the ARMv8 CRC32 instructions, 8 bytes at a time
+CRC32_ARMV8_TARGET static unsigned crc32_armv8(unsigned crc, const uint8_t *buf,
+                                               unsigned len)
+{
+    uint32_t c = crc ^ 0xffffffffL;
+    for( ; len >= 8; len -= 8, buf += 8 )
+    {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        c = __crc32d(c, v);
+    }
+    while( len-- )
+        c = __crc32b(c, *buf++);
+    return c ^ 0xffffffffL;
+}
+
+static int have_armv8_crc(void)
+{
+#ifdef __linux__
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    return 1;
+#endif
+}
+#endif
+
+static struct crc32_engine engines[] = {
+    {"bytewise", crc32_bytewise, 1},
+    {"slice8", crc32_slice8, 1},
+#ifdef CRC32_CLMUL
+    {"pclmul", crc32_clmul, 0},
+#endif
+#ifdef CRC32_ARMV8
+    {"armv8", crc32_armv8, 0},
+#endif
+    {0, 0, 0}};
+
+static unsigned (*crc32_best)(unsigned, const uint8_t *, unsigned) = crc32_slice8;
+
+// Marks the hardware engine as available and uses it in crc32()
+static void use_engine(unsigned (*fn)(unsigned, const uint8_t *, unsigned))
+{
+    for( struct crc32_engine *e = engines; e->name; e++ )
+        if( e->crc32 == fn )
+            e->available = 1;
+    crc32_best = fn;
+}
+
+// Builds the slicing tables and selects the fastest engine, before main().
+__attribute__((constructor)) static void crc32_init(void)
+{
+    for( int i = 0; i < 256; i++ )
+    {
+        unsigned c      = crc_table[i];
+        crc_slice[0][i] = c;
+        for( int j = 1; j < 8; j++ )
+        {
+            c               = crc_table[c & 0xFF] ^ (c >> 8);
+            crc_slice[j][i] = c;
+        }
+    }
+#ifdef CRC32_CLMUL
+    if( have_clmul() )
+        use_engine(crc32_clmul);
+#endif
+#ifdef CRC32_ARMV8
+    if( have_armv8_crc() )
+        use_engine(crc32_armv8);
+#endif
+}
+
+const struct crc32_engine *crc32_engines(void)
+{
+    return engines;
+}
+
+unsigned crc32(unsigned crc, const uint8_t *buf, unsigned len)
+{
+    return crc32_best(crc, buf, len);
+}
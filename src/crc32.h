@@ -21,3 +21,14 @@
 #include <stdint.h>
 
 unsigned crc32(unsigned crc, const uint8_t *buf, unsigned len);
+
+// A CRC32 implementation, crc32() uses the fastest available one.
+struct crc32_engine
+{
+    const char *name;
+    unsigned (*crc32)(unsigned crc, const uint8_t *buf, unsigned len);
+    int available; // Supported by this CPU
+};
+
+// Returns all the implementations built in, ending with a null name.
+const struct crc32_engine *crc32_engines(void);
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Checks all CRC32 implementations against the byte-wise one and compares
+ * their speed.
+ */
+#include "crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SIZE (16 * 1024 * 1024)
+#define BENCH_LOOPS 8
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Compares with the reference at all small lengths and alignments
+static int check(const struct crc32_engine *ref, const struct crc32_engine *e,
+                 const uint8_t *data)
+{
+    for( unsigned ofs = 0; ofs < 16; ofs++ )
+        for( unsigned len = 0; len < 1024; len++ )
+        {
+            unsigned seed = len * 0x9E3779B9u;
+            if( e->crc32(seed, data + ofs, len) != ref->crc32(seed, data + ofs, len) )
+            {
+                printf("%-10s FAIL at offset %u, length %u\n", e->name, ofs, len);
+                return 1;
+            }
+        }
+    if( e->crc32(0, data, BENCH_SIZE) != ref->crc32(0, data, BENCH_SIZE) )
+    {
+        printf("%-10s FAIL with full buffer\n", e->name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    uint8_t *data = malloc(BENCH_SIZE);
+    if( !data )
+        return 1;
+    srand(1);
+    for( unsigned i = 0; i < BENCH_SIZE; i++ )
+        data[i] = rand() >> 7;
+
+    const struct crc32_engine *ref = crc32_engines();
+    double ref_time = 0;
+    int err = 0;
+    for( const struct crc32_engine *e = crc32_engines(); e->name; e++ )
+    {
+        if( !e->available )
+        {
+            printf("%-10s not supported by this CPU\n", e->name);
+            continue;
+        }
+        if( check(ref, e, data) )
+        {
+            err = 1;
+            continue;
+        }
+        double t = now();
+        unsigned crc = 0;
+        for( int i = 0; i < BENCH_LOOPS; i++ )
+            crc = e->crc32(crc, data, BENCH_SIZE);
+        t = now() - t;
+        if( e == ref )
+            ref_time = t;
+        printf("%-10s %08X %8.1f MB/s %6.2fx\n", e->name, crc,
+               BENCH_LOOPS * (BENCH_SIZE / 1048576.0) / t, ref_time / t);
+    }
+    free(data);
+    return err;
+}
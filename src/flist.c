@@ -18,9 +18,11 @@
  * Manages the list of files & directories
  */
 #include "flist.h"
+#include "arena.h"
 #include "convert.h"
 #include "msg.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,21 +31,320 @@
 #include <time.h>
 #include <unistd.h>
 
+#if !( defined(_WIN32) || defined(__WIN32__) )
+#define FLIST_MMAP 1
+#define FLIST_THREADS 1
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+/* Max file size in bytes, 16MB */
+#define MAX_FILE_SIZE 0x1000000
+
 static int convert_utf8_to_atascii_enabled = 0;
 
-static char *read_file(const char *fname, size_t size)
+// Hash table of entries, with open addressing
+struct ftable
+{
+    struct afile **slot;
+    uint32_t *hash;
+    unsigned mask; // Table size - 1, the size is a power of two
+    unsigned count;
+};
+
+// Lookup tables and memory of the file list, stored in the main directory
+struct flist_index
+{
+    struct ftable dirs;  // Directories, by host path name
+    struct ftable names; // All entries, by parent directory and Atari name
+    struct arena mem;    // Entries and names
+};
+
+// FNV-1a hash
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while( len-- )
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+#define HASH_INIT 2166136261u
+
+static uint32_t name_hash(const struct afile *dir, const char *aname)
+{
+    return hash_bytes(hash_bytes(HASH_INIT, &dir, sizeof(dir)), aname, 11);
+}
+
+static void ftable_insert(struct ftable *t, uint32_t h, struct afile *f)
+{
+    unsigned i = h & t->mask;
+    while( t->slot[i] )
+        i = (i + 1) & t->mask;
+    t->slot[i] = f;
+    t->hash[i] = h;
+}
+
+// Adds an entry, growing the table to keep it at most half full
+static void ftable_add(struct ftable *t, uint32_t h, struct afile *f)
+{
+    if( 2 * (t->count + 1) > t->mask + 1 )
+    {
+        struct ftable old = *t;
+        unsigned size     = old.slot ? 2 * (old.mask + 1) : 64;
+        t->slot           = check_calloc(size, sizeof(t->slot[0]));
+        t->hash           = check_calloc(size, sizeof(t->hash[0]));
+        t->mask           = size - 1;
+        if( old.slot )
+        {
+            for( unsigned i = 0; i <= old.mask; i++ )
+                if( old.slot[i] )
+                    ftable_insert(t, old.hash[i], old.slot[i]);
+        }
+        free(old.slot);
+        free(old.hash);
+    }
+    ftable_insert(t, h, f);
+    t->count++;
+}
+
+// Returns the directory with the given host path name and length
+static struct afile *find_dir(const struct ftable *t, uint32_t h, const char *fname,
+                              size_t len)
+{
+    for( unsigned i = h & t->mask; t->slot[i]; i = (i + 1) & t->mask )
+    {
+        const struct afile *f = t->slot[i];
+        if( t->hash[i] == h && !strncmp(f->fname, fname, len) && !f->fname[len] )
+            return t->slot[i];
+    }
+    return 0;
+}
+
+// Returns the entry with the given parent directory and Atari name
+static struct afile *find_name(const struct ftable *t, const struct afile *dir,
+                               const char *aname)
+{
+    uint32_t h = name_hash(dir, aname);
+    for( unsigned i = h & t->mask; t->slot[i]; i = (i + 1) & t->mask )
+    {
+        const struct afile *f = t->slot[i];
+        if( t->hash[i] == h && f->dir == dir && !strncmp(f->aname, aname, 11) )
+            return t->slot[i];
+    }
+    return 0;
+}
+
+// Returns the deepest directory whose host path is a prefix of "fname"
+static struct afile *find_parent(struct flist_index *idx, const char *fname)
+{
+    // Hash all prefixes, then search from the longest
+    size_t len     = strlen(fname);
+    uint32_t *hash = check_malloc((len + 1) * sizeof(uint32_t));
+    hash[0]        = HASH_INIT;
+    for( size_t i = 0; i < len; i++ )
+        hash[i + 1] = hash_bytes(hash[i], fname + i, 1);
+
+    struct afile *dir = 0;
+    for( size_t i = len + 1; i-- > 0 && !dir; )
+        dir = find_dir(&idx->dirs, hash[i], fname, i);
+    free(hash);
+    return dir;
+}
+
+// Adds the entry to the lookup tables
+static void index_add(struct flist_index *idx, struct afile *f)
+{
+    if( f->is_dir )
+        ftable_add(&idx->dirs, hash_bytes(HASH_INIT, f->fname, strlen(f->fname)), f);
+    ftable_add(&idx->names, name_hash(f->dir, f->aname), f);
+}
+
+// Errors loading a file, reported in list order after all are loaded
+enum load_error
+{
+    load_ok = 0,
+    load_open,
+    load_read,
+    load_big
+};
+
+// Loading of one file, done in a worker thread
+struct load_job
+{
+    struct afile *f;
+    enum load_error error;
+    int err;         // errno value for the error
+    int conv_failed; // UTF8 conversion failed, using original data
+};
+
+// Reads the file until the end, "size" is the expected size and returns the
+// size read. Used for pipes and for files that can't be mapped.
+static char *read_file(struct load_job *job, size_t *size)
 {
-    char *data;
-    FILE *f = fopen(fname, "rb");
+    FILE *f = fopen(job->f->fname, "rb");
     if( !f )
-        show_error("can't open file '%s': %s", fname, strerror(errno));
-    data = check_malloc(size);
-    if( size != fread(data, 1, size, f) )
-        show_error("error reading file '%s': %s", fname, strerror(errno));
+    {
+        job->error = load_open;
+        job->err   = errno;
+        return 0;
+    }
+    size_t len = 0, alloc = *size ? *size + 1 : 4096;
+    char *data = check_malloc(alloc);
+    for( ;; )
+    {
+        len += fread(data + len, 1, alloc - len, f);
+        if( len < alloc || len > MAX_FILE_SIZE )
+            break;
+        alloc *= 2;
+        data = check_realloc(data, alloc);
+    }
+    if( ferror(f) || len > MAX_FILE_SIZE )
+    {
+        job->error = ferror(f) ? load_read : load_big;
+        job->err   = errno;
+        fclose(f);
+        free(data);
+        return 0;
+    }
     fclose(f);
+    *size = len;
     return data;
 }
 
+// Maps the file read-only, returns 0 if not possible. The size is checked
+// again on the open file, files that changed since flist_add_file() are read
+// instead, as mapping past the end of the file faults on access.
+static char *map_file(const struct afile *f)
+{
+#ifdef FLIST_MMAP
+    int fd = open(f->fname, O_RDONLY);
+    if( fd < 0 )
+        return 0;
+    struct stat st;
+    if( fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+        st.st_size > MAX_FILE_SIZE || (size_t)st.st_size != f->map_size )
+    {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED )
+        return 0;
+    return map;
+#else
+    return 0;
+#endif
+}
+
+// Frees the file data, mapped or read.
+static void free_file(struct afile *f)
+{
+#ifdef FLIST_MMAP
+    if( f->map_size )
+    {
+        munmap(f->data, f->map_size);
+        f->map_size = 0;
+        return;
+    }
+#endif
+    free(f->data);
+}
+
+// Loads the file data, mapping or reading it, and converts if enabled
+static void load_file(struct load_job *job)
+{
+    struct afile *f = job->f;
+    // Map regular files, flist_add_file() sets "map_size" for those. The data
+    // is copied only to the image.
+    f->data = f->map_size ? map_file(f) : 0;
+    if( !f->data )
+    {
+        f->map_size = 0;
+        f->data     = read_file(job, &f->size);
+        if( !f->data )
+            return;
+    }
+
+    // Convert if enabled
+    if( convert_utf8_to_atascii_enabled )
+    {
+        uint8_t *converted = NULL;
+        size_t converted_size = 0;
+        if( convert_buffer_utf8_to_atascii((const uint8_t *)f->data, f->size, &converted, &converted_size) == 0 )
+        {
+            free_file(f);
+            f->data = (char *)converted;
+            f->size = converted_size;
+        }
+        else
+            job->conv_failed = 1;
+    }
+}
+
+// Pool of threads loading files
+struct load_pool
+{
+    struct load_job *jobs;
+    unsigned count;
+    unsigned next; // Next job to start
+#ifdef FLIST_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef FLIST_THREADS
+static void *load_worker(void *arg)
+{
+    struct load_pool *pool = arg;
+    for( ;; )
+    {
+        pthread_mutex_lock(&pool->lock);
+        unsigned n = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if( n >= pool->count )
+            break;
+        load_file(&pool->jobs[n]);
+    }
+    return 0;
+}
+#endif
+
+// Loads all the jobs, using one thread per CPU
+static void run_pool(struct load_pool *pool)
+{
+#ifdef FLIST_THREADS
+    unsigned threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if( ncpu > 1 )
+        threads = ncpu;
+#endif
+    if( threads > pool->count )
+        threads = pool->count;
+    if( threads > 1 )
+    {
+        pthread_t *thr = check_calloc(threads, sizeof(pthread_t));
+        pthread_mutex_init(&pool->lock, 0);
+        unsigned started = 0;
+        for( ; started < threads; started++ )
+            if( pthread_create(&thr[started], 0, load_worker, pool) )
+                break;
+        // With no threads, load all the files here
+        if( !started )
+            load_worker(pool);
+        for( unsigned i = 0; i < started; i++ )
+            pthread_join(thr[i], 0);
+        pthread_mutex_destroy(&pool->lock);
+        free(thr);
+        return;
+    }
+#endif
+    for( ; pool->next < pool->count; pool->next++ )
+        load_file(&pool->jobs[pool->next]);
+}
+
 // Checks if given character is a PATH separator
 static int is_separator(char c)
 {
@@ -54,12 +355,10 @@ static int is_separator(char c)
 #endif
 }
 
-static char *atari_name(const char *fname)
+static char *atari_name(struct arena *mem, const char *fname)
 {
     // Convert to 8+3 filename
-    char *out = strdup("           ");
-    if( !out )
-        memory_error();
+    char *out = arena_strdup(mem, "           ");
 
     // Search last part of filename (similar to "basename")
     const char *in, *p;
@@ -104,10 +403,10 @@ static char *atari_name(const char *fname)
     return out;
 }
 
-static char *path_name(const char *dir, const char *name)
+static char *path_name(struct arena *mem, const char *dir, const char *name)
 {
     size_t n  = strlen(dir);
-    char *ret = check_malloc(n + 14);
+    char *ret = arena_alloc(mem, n + 14);
     strncpy(ret, dir, n + 14);
     ret[n + 13] = '\0'; // Ensure null termination
     ret[n++] = '>';
@@ -127,8 +426,9 @@ static char *path_name(const char *dir, const char *name)
 
 void flist_add_main_dir(file_list *flist)
 {
-    // Creates MAIN directory
-    struct afile *dir = check_malloc(sizeof(struct afile));
+    // Creates MAIN directory, holding the lookup tables
+    struct flist_index *idx = check_calloc(1, sizeof(struct flist_index));
+    struct afile *dir       = arena_alloc(&idx->mem, sizeof(struct afile));
     // Convert time to broken time
     time_t ttim    = time(0);
     struct tm *tim = localtime(&ttim);
@@ -146,12 +446,63 @@ void flist_add_main_dir(file_list *flist)
     dir->size      = 23;
     dir->is_dir    = 1;
     dir->boot_file = 0;
-    dir->data      = check_malloc(SFS_MAX_DIR_SIZE);
+    dir->data      = 0;
+    dir->alloc     = 0;
+    dir->map_size  = 0;
     dir->level     = 0;
+    dir->pending   = 0;
+    dir->index     = idx;
 
+    index_add(dir->index, dir);
     darray_add(flist, dir);
 }
 
+static struct afile *main_dir(file_list *flist)
+{
+    struct afile *root = darray_len(flist) ? darray_i(flist, 0) : 0;
+    if( !root || !root->index )
+        show_error("internal error - no main directory");
+    return root;
+}
+
+void flist_set_time(struct afile *af, time_t mtime)
+{
+    // Convert time to broken time
+    struct tm *tim = localtime(&mtime);
+
+    af->date[0] = tim->tm_mday;
+    af->date[1] = tim->tm_mon + 1;
+    af->date[2] = tim->tm_year % 100;
+    af->time[0] = tim->tm_hour;
+    af->time[1] = tim->tm_min;
+    af->time[2] = tim->tm_sec;
+}
+
+// Allocates a new entry inside "dir", with the Atari name taken from "name"
+static struct afile *new_entry(struct afile *root, struct afile *dir, const char *fname,
+                               const char *name, time_t mtime, enum fattr attribs)
+{
+    struct arena *mem = &root->index->mem;
+    struct afile *f   = arena_alloc(mem, sizeof(struct afile));
+
+    flist_set_time(f, mtime);
+    f->aname   = atari_name(mem, name);
+    f->pname   = path_name(mem, dir->pname, f->aname);
+    f->fname   = fname ? arena_strdup(mem, fname) : f->pname;
+    f->dir     = dir;
+    f->level   = dir->level + 1;
+    f->attribs = attribs;
+    f->index   = 0;
+
+    if( !f->aname || !strcmp(f->aname, "           ") )
+        show_error("can't add file/directory named '%s'", name);
+
+    // Search for repeated files
+    if( find_name(&root->index->names, f->dir, f->aname) )
+        show_error("repeated file/directory named '%s'", f->pname);
+    return f;
+}
+
 void flist_add_file(file_list *flist, const char *fname, int boot_file,
                     enum fattr attribs)
 {
@@ -160,97 +511,176 @@ void flist_add_file(file_list *flist, const char *fname, int boot_file,
     if( 0 != stat(fname, &st) )
         show_error("reading input file '%s': %s", fname, strerror(errno));
 
-    if( S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) )
+    if( S_ISREG(st.st_mode) || S_ISDIR(st.st_mode) || S_ISFIFO(st.st_mode) )
     {
-        struct afile *f = check_malloc(sizeof(struct afile));
-
-        // Search in the file list if the path is inside an added directory
-        struct afile *dir = 0, **ptr;
-        darray_foreach(ptr, flist)
-        {
-            struct afile *af = *ptr;
-            if( af->is_dir && fname == strstr(fname, af->fname) &&
-                (!dir || strlen(dir->fname) < strlen(af->fname)) )
-                dir = af;
-        }
-
-        if( !dir )
-            show_error("internal error - no main directory");
-
-        // Convert time to broken time
-        struct tm *tim = localtime(&st.st_mtime);
-
-        f->date[0] = tim->tm_mday;
-        f->date[1] = tim->tm_mon + 1;
-        f->date[2] = tim->tm_year % 100;
-        f->time[0] = tim->tm_hour;
-        f->time[1] = tim->tm_min;
-        f->time[2] = tim->tm_sec;
-        f->fname   = fname;
-        f->aname   = atari_name(fname);
-        f->pname   = path_name(dir->pname, f->aname);
-        f->dir     = dir;
-        f->level   = dir->level + 1;
-        f->attribs = attribs;
-
-        if( !f->aname || !strcmp(f->aname, "           ") )
-            show_error("can't add file/directory named '%s'", fname);
-
-        // Search for repeated files
-        darray_foreach(ptr, flist)
-        {
-            struct afile *af = *ptr;
-            if( af->dir == f->dir && !strncmp(af->aname, f->aname, 11) )
-                show_error("repeated file/directory named '%s'", f->pname);
-        }
+        // Search the deepest added directory that contains the path
+        struct afile *root = main_dir(flist);
+        struct afile *dir  = find_parent(root->index, fname);
+        struct afile *f    = new_entry(root, dir, fname, fname, st.st_mtime, attribs);
 
         if( S_ISDIR(st.st_mode) )
         {
             f->size      = 23;
             f->is_dir    = 1;
             f->boot_file = 0;
-            f->data      = check_malloc(SFS_MAX_DIR_SIZE);
-
-            show_msg("added dir  '%-20s', from '%s'.", f->pname, f->fname);
+            f->data      = 0;
+            f->alloc     = 0;
+            f->map_size  = 0;
         }
         else
         {
-            if( st.st_size > 0x1000000 )
+            if( st.st_size > MAX_FILE_SIZE )
                 show_error("file size too big '%s'", fname);
 
-            f->size      = st.st_size;
+            // Data is loaded later by flist_load(), mapping regular files
+            f->size      = S_ISREG(st.st_mode) ? st.st_size : 0;
             f->is_dir    = 0;
             f->boot_file = boot_file;
-            f->data      = read_file(f->fname, f->size);
-
-            // Convert if enabled
-            if( convert_utf8_to_atascii_enabled )
-            {
-                uint8_t *converted = NULL;
-                size_t converted_size = 0;
-                if( convert_buffer_utf8_to_atascii((const uint8_t *)f->data, f->size, &converted, &converted_size) == 0 )
-                {
-                    free(f->data);
-                    f->data = (char *)converted;
-                    f->size = converted_size;
-                }
-                else
-                {
-                    show_msg("warning: conversion failed for %s, using original", fname);
-                }
-            }
-
-            show_msg("added file '%-20s', %5ld bytes, from '%s'%s%s%s%s.", f->pname,
-                     (long)f->size, f->fname, attribs & at_protected ? ", +p" : "",
-                     attribs & at_hidden ? ", +h" : "",
-                     attribs & at_archived ? ", +a" : "", boot_file ? ", (boot)" : "");
+            f->data      = 0;
+            f->alloc     = 0;
+            f->map_size  = S_ISREG(st.st_mode) ? f->size : 0;
         }
+        f->pending = 1;
+        index_add(root->index, f);
         darray_add(flist, f);
     }
     else
         show_error("invalid file type '%s'", fname);
 }
 
+struct afile *flist_add_dir(file_list *flist, struct afile *dir, const char *name)
+{
+    struct afile *root = main_dir(flist);
+    if( !dir )
+        dir = root;
+
+    // The same directory can be given in many paths, return the first one
+    struct afile *f = find_name(&root->index->names, dir, atari_name(&root->index->mem, name));
+    if( f && f->is_dir )
+        return f;
+
+    f                  = new_entry(root, dir, 0, name, time(0), 0);
+    f->size            = 23;
+    f->is_dir          = 1;
+    f->boot_file       = 0;
+    f->data            = 0;
+    f->alloc           = 0;
+    f->map_size        = 0;
+    f->pending         = 0;
+    // Not a host directory, so only searched by name
+    ftable_add(&root->index->names, name_hash(f->dir, f->aname), f);
+    darray_add(flist, f);
+    return f;
+}
+
+struct afile *flist_add_data(file_list *flist, struct afile *dir, const char *name, char *data,
+                             size_t size, enum fattr attribs)
+{
+    if( size > MAX_FILE_SIZE )
+        show_error("file size too big '%s'", name);
+    struct afile *root = main_dir(flist);
+    struct afile *f    = new_entry(root, dir ? dir : root, 0, name, time(0), attribs);
+    f->size            = size;
+    f->is_dir          = 0;
+    f->boot_file       = 0;
+    f->data            = data;
+    f->alloc           = 0;
+    f->map_size        = 0;
+    f->pending         = 0;
+    index_add(root->index, f);
+    darray_add(flist, f);
+    return f;
+}
+
+struct afile *flist_find(file_list *flist, struct afile *dir, const char *aname)
+{
+    struct afile *root = main_dir(flist);
+    return find_name(&root->index->names, dir ? dir : root, aname);
+}
+
+void flist_load(file_list *flist)
+{
+    // Get files to load
+    struct load_pool pool = { 0 };
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        if( (*ptr)->pending && !(*ptr)->is_dir )
+            pool.count++;
+    }
+    pool.jobs = check_calloc(pool.count ? pool.count : 1, sizeof(struct load_job));
+    unsigned n = 0;
+    darray_foreach(ptr, flist)
+    {
+        if( (*ptr)->pending && !(*ptr)->is_dir )
+            pool.jobs[n++].f = *ptr;
+    }
+
+    run_pool(&pool);
+
+    // Show results in list order
+    n = 0;
+    darray_foreach(ptr, flist)
+    {
+        struct afile *f = *ptr;
+        if( !f->pending )
+            continue;
+        f->pending = 0;
+        if( f->is_dir )
+        {
+            show_msg("added dir  '%-20s', from '%s'.", f->pname, f->fname);
+            continue;
+        }
+        struct load_job *job = &pool.jobs[n++];
+        if( job->error == load_open )
+            show_error("can't open file '%s': %s", f->fname, strerror(job->err));
+        else if( job->error == load_read )
+            show_error("error reading file '%s': %s", f->fname, strerror(job->err));
+        else if( job->error == load_big )
+            show_error("file size too big '%s'", f->fname);
+        if( job->conv_failed )
+            show_msg("warning: conversion failed for %s, using original", f->fname);
+
+        show_msg("added file '%-20s', %5ld bytes, from '%s'%s%s%s%s.", f->pname,
+                 (long)f->size, f->fname, f->attribs & at_protected ? ", +p" : "",
+                 f->attribs & at_hidden ? ", +h" : "",
+                 f->attribs & at_archived ? ", +a" : "", f->boot_file ? ", (boot)" : "");
+    }
+    free(pool.jobs);
+}
+
+void flist_dir_reserve(struct afile *dir, size_t size)
+{
+    if( size > dir->alloc )
+    {
+        dir->data  = check_realloc(dir->data, size);
+        dir->alloc = size;
+    }
+}
+
+void flist_free(file_list *flist)
+{
+    // The list can be sorted, search the main directory
+    struct flist_index *idx = 0;
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        free_file(*ptr);
+        if( (*ptr)->index )
+            idx = (*ptr)->index;
+    }
+    if( idx )
+    {
+        free(idx->dirs.slot);
+        free(idx->dirs.hash);
+        free(idx->names.slot);
+        free(idx->names.hash);
+        arena_free(&idx->mem);
+        free(idx);
+    }
+    darray_delete(*flist);
+}
+
 void flist_set_convert_utf8_to_atascii(int enable)
 {
     convert_utf8_to_atascii_enabled = enable;
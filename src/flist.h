@@ -20,6 +20,7 @@
 #pragma once
 
 #include "darray.h"
+#include <time.h>
 
 /* File attributes */
 enum fattr
@@ -34,15 +35,19 @@ struct afile
 {
     const char *fname;
     const char *aname;
-    const char *pname; // Full path name
+    const char *pname;         // Full path name
     char *data;
     size_t size;
-    struct afile *dir; // Parent directory
-    int level;         // Level inside directory structure, 0 = root
+    size_t alloc;              // Allocated size of "data" for directories
+    size_t map_size;           // Size of the file mapping holding "data", 0 if allocated
+    struct afile *dir;         // Parent directory
+    int level;                 // Level inside directory structure, 0 = root
     int is_dir;
     enum fattr attribs;
     int boot_file;
     int map_sect;
+    int pending;               // Added but not loaded by flist_load() yet
+    struct flist_index *index; // Lookup tables and memory, only in the main directory
     char date[3];
     char time[3];
 };
@@ -52,7 +57,29 @@ struct afile
 
 typedef darray(struct afile *) file_list;
 
+// Adds the main directory, must be the first entry in the list.
 void flist_add_main_dir(file_list *flist);
+// Adds a file or directory, the file data is not read until flist_load().
 void flist_add_file(file_list *flist, const char *fname, int boot_file,
                     enum fattr attribs);
+// Adds a directory, or a file with the data in memory, inside "dir" or inside
+// the main directory if "dir" is null. The Atari name is made from "name", and
+// the date is the current one. The data must be allocated with malloc() and
+// is owned by the list. Returns the new entry, or the existing directory if
+// one with the same name was already added.
+struct afile *flist_add_dir(file_list *flist, struct afile *dir, const char *name);
+struct afile *flist_add_data(file_list *flist, struct afile *dir, const char *name, char *data,
+                             size_t size, enum fattr attribs);
+// Sets the date and time of the entry from "mtime", in local time.
+void flist_set_time(struct afile *af, time_t mtime);
+// Returns the entry with the padded 8+3 name "aname" inside "dir", or inside
+// the main directory if null. Returns null if not found.
+struct afile *flist_find(file_list *flist, struct afile *dir, const char *aname);
+// Loads the data of all files added since the last call, in parallel, and shows
+// the added files and any errors in the order they were added.
+void flist_load(file_list *flist);
+// Grows the data of the directory to hold at least "size" bytes.
+void flist_dir_reserve(struct afile *dir, size_t size);
+// Frees all the entries and their data, and the list.
+void flist_free(file_list *flist);
 void flist_set_convert_utf8_to_atascii(int enable);
\ No newline at end of file
@@ -17,6 +17,7 @@
 /*
  * Loads an ATR with a SpartaDOS file-system and list contents.
  */
+#define _GNU_SOURCE
 #include "atr.h"
 #include "compat.h"
 #include "lsdos.h"
@@ -24,47 +25,412 @@
 #include "lshowfen.h"
 #include "lssfs.h"
 #include "msg.h"
+#include "probe.h"
+#include "sfsdir.h"
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if !( defined(_WIN32) || defined(__WIN32__) )
+#define LSATR_THREADS 1
+#include <pthread.h>
+#endif
+
 //---------------------------------------------------------------------
 static void show_usage(void)
 {
-    printf("Usage: %s [options] <atr_image_file>\n"
+    printf("Usage: %s [options] <atr_image_file|directory>...\n"
            "Options:\n"
            "\t-a\tShow listing in Atari instead of UNIX format.\n"
            "\t-l\tConvert filenames to lower-case.\n"
            "\t-x\tExtract listed files to current path.\n"
            "\t-X path\tExtract listed files to given path.\n"
            "\t-f\tForce overwrite of existing files.\n"
+           "\t-j num\tNumber of images to process in parallel, default is the\n"
+           "\t\tnumber of CPUs.\n"
            "\t-q\tQuiet mode, suppress informational messages.\n"
            "\t--verify\tVerify ATR image integrity.\n"
+           "\t--lazy\tRead sectors on demand instead of loading the full image.\n"
+           "\t--identify\tOnly show the image format, sector size, sector count and\n"
+           "\t\tconfidence of the detection, reading a few sectors.\n"
            "\t-h\tShow this help.\n"
-           "\t-v\tShow version information.\n",
+           "\t-v\tShow version information.\n"
+           "\n"
+           "Directories are searched recursively for '.atr' and '.xfd' images. When\n"
+           "extracting more than one image, each one is extracted to a path with the\n"
+           "name of the image without the extension.\n",
            prog_name);
     exit(EXIT_SUCCESS);
 }
 
+//---------------------------------------------------------------------
+// What to do with each image
+enum ls_mode
+{
+    ls_list,
+    ls_verify,
+    ls_identify
+};
+
+struct ls_job
+{
+    const char *atr_name;
+    char *file_name; // Path to open, as we change to the extract path
+    char *ext_dir; // Extract path, only with more than one image
+    char *out;     // Buffered output and messages
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    struct ls_res res; // Resources of the image, released on errors
+    int result;
+    int done;
+};
+
+struct ls_pool
+{
+    struct ls_job *jobs;
+    unsigned count;
+    unsigned next;    // Next job to start
+    unsigned printed; // Jobs with the output already printed
+    unsigned ahead;   // Max jobs started after the last printed
+    enum ls_mode mode;
+    int lazy_load;
+    const struct ls_opts *opt;
+#ifdef LSATR_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_cond_t room;
+#endif
+};
+
+// Releases the resources of the image still held by the readers
+static void release_res(struct ls_res *res)
+{
+    if( res->fd != -1 )
+        close(res->fd);
+    free(res->data);
+    if( res->idx )
+        sfs_index_free(res->idx);
+    if( res->atr )
+        atr_free(res->atr);
+    res->atr  = 0;
+    res->idx  = 0;
+    res->data = 0;
+    res->fd   = -1;
+}
+
+// Process one image, returns 0 on success. The image is kept in "opt->res".
+static int read_image(const char *file_name, const char *atr_name, enum ls_mode mode,
+                      int lazy_load, const struct ls_opts *opt)
+{
+    // Identify mode - only read the header and a few sectors
+    if( mode == ls_identify )
+    {
+        struct atr_probe p;
+        if( atr_probe(file_name, &p) )
+        {
+            fprintf(msg_out(), "%s\tinvalid\n", atr_name);
+            return 1;
+        }
+        fprintf(msg_out(), "%s\t%s\t%u\t%u\t%d\n", atr_name, p.fs ? p.fs : "unknown",
+                p.sec_size, p.sec_count, p.confidence);
+        return p.fs ? 0 : 1;
+    }
+
+    // Load ATR image file
+    struct atr_image *atr = atr_open(file_name, lazy_load ? atr_load_lazy : atr_load_map);
+    if( !atr )
+        return 1;
+    opt->res->atr = atr;
+
+    // Verify mode - just check if image loads and is valid
+    if( mode == ls_verify )
+    {
+        if( atr->sec_count < 1 || (atr->sec_size != 128 && atr->sec_size != 256) )
+            show_error("%s: invalid ATR image", atr_name);
+        fprintf(msg_out(), "%s: ATR image verified - %u sectors of %u bytes\n", atr_name,
+                atr->sec_count, atr->sec_size);
+        release_res(opt->res);
+        return 0;
+    }
+
+    int e = sfs_read(atr, atr_name, opt);
+    if( e )
+        e = howfen_read(atr, atr_name, opt);
+    if( e )
+        e = dos_read(atr, atr_name, opt);
+    if( e )
+        e = extra_read(atr, atr_name, opt);
+    if( e )
+        show_msg("%s: ATR image format not supported.", atr_name);
+    release_res(opt->res);
+    return e;
+}
+
+// Creates all the components of the path
+static void make_path(const char *path)
+{
+    char *dir = strdup(path);
+    for( char *p = dir;; p++ )
+    {
+        if( *p && *p != '/' )
+            continue;
+        char c = *p;
+        *p     = 0;
+        struct stat st;
+        if( *dir && (stat(dir, &st) || !S_ISDIR(st.st_mode)) )
+        {
+            // Other thread could create the path at the same time
+            if( compat_mkdir(dir) && errno != EEXIST )
+                show_error("can't create path, '%s': %s", dir, strerror(errno));
+        }
+        *p = c;
+        if( !c )
+            break;
+    }
+    free(dir);
+}
+
+// Process one job, capturing the output and errors if "out" and "err" are given
+static void run_job(struct ls_pool *pool, struct ls_job *job, FILE *out, FILE *err)
+{
+    jmp_buf trap;
+    struct ls_opts opt = *pool->opt;
+    opt.ext_dir        = job->ext_dir;
+    opt.res            = &job->res;
+    job->res.fd        = -1;
+    msg_redirect(out, err, &trap);
+    if( setjmp(trap) )
+    {
+        // The reader stopped with an error, release what it left open
+        release_res(&job->res);
+        job->result = 1;
+    }
+    else
+    {
+        if( opt.extract_files && opt.ext_dir && pool->mode == ls_list )
+            make_path(opt.ext_dir);
+        job->result =
+            read_image(job->file_name, job->atr_name, pool->mode, pool->lazy_load, &opt);
+    }
+    msg_redirect(0, 0, 0);
+}
+
+#ifdef LSATR_THREADS
+static void *pool_worker(void *arg)
+{
+    struct ls_pool *pool = arg;
+    for( ;; )
+    {
+        // Don't start jobs too far ahead of the printed output, as the output
+        // of all the jobs in between is kept in memory
+        pthread_mutex_lock(&pool->lock);
+        unsigned n = pool->next++;
+        while( n < pool->count && n >= pool->printed + pool->ahead )
+            pthread_cond_wait(&pool->room, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        if( n >= pool->count )
+            break;
+
+        struct ls_job *job = &pool->jobs[n];
+        FILE *out          = open_memstream(&job->out, &job->out_len);
+        FILE *err          = open_memstream(&job->err, &job->err_len);
+        if( !out || !err )
+            memory_error();
+        run_job(pool, job, out, err);
+        fclose(out);
+        fclose(err);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+#endif
+
+// Process all jobs with the given number of threads, printing the output of
+// each image in order. Returns 0 if all images were processed ok.
+static int run_pool(struct ls_pool *pool, unsigned threads)
+{
+    int e = 0;
+#ifdef LSATR_THREADS
+    if( threads > pool->count )
+        threads = pool->count;
+    if( threads > 1 )
+    {
+        pthread_t *thr = check_calloc(threads, sizeof(pthread_t));
+        pool->ahead    = 2 * threads;
+        pthread_mutex_init(&pool->lock, 0);
+        pthread_cond_init(&pool->done, 0);
+        pthread_cond_init(&pool->room, 0);
+        for( unsigned i = 0; i < threads; i++ )
+            if( pthread_create(&thr[i], 0, pool_worker, pool) )
+                show_error("can't create thread: %s", strerror(errno));
+
+        // Print output of each job as soon as all the previous are done
+        for( unsigned i = 0; i < pool->count; i++ )
+        {
+            struct ls_job *job = &pool->jobs[i];
+            pthread_mutex_lock(&pool->lock);
+            while( !job->done )
+                pthread_cond_wait(&pool->done, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+            fwrite(job->out, 1, job->out_len, stdout);
+            fflush(stdout);
+            fwrite(job->err, 1, job->err_len, stderr);
+            free(job->out);
+            free(job->err);
+            e |= job->result;
+
+            pthread_mutex_lock(&pool->lock);
+            pool->printed = i + 1;
+            pthread_cond_broadcast(&pool->room);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        for( unsigned i = 0; i < threads; i++ )
+            pthread_join(thr[i], 0);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->room);
+        free(thr);
+        return e;
+    }
+#endif
+    // Process in order, without capturing the output
+    for( unsigned i = 0; i < pool->count; i++ )
+    {
+        run_job(pool, &pool->jobs[i], 0, 0);
+        fflush(stdout);
+        e |= pool->jobs[i].result;
+    }
+    return e;
+}
+
+//---------------------------------------------------------------------
+// List of images to process
+struct name_list
+{
+    char **names;
+    unsigned count;
+    unsigned size;
+};
+
+static void add_name(struct name_list *list, char *name)
+{
+    if( list->count == list->size )
+    {
+        list->size  = list->size ? list->size * 2 : 64;
+        list->names = check_realloc(list->names, list->size * sizeof(char *));
+    }
+    list->names[list->count++] = name;
+}
+
+static int is_image_name(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (!strcasecmp(ext, ".atr") || !strcasecmp(ext, ".xfd"));
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds all images inside the directory, recursively, sorted by name
+static void add_dir(struct name_list *list, const char *path)
+{
+    DIR *dir = opendir(path);
+    if( !dir )
+    {
+        show_msg("%s: can't read directory, %s", path, strerror(errno));
+        return;
+    }
+    struct name_list ent = {0};
+    struct dirent *d;
+    while( 0 != (d = readdir(dir)) )
+    {
+        if( !strcmp(d->d_name, ".") || !strcmp(d->d_name, "..") )
+            continue;
+        char *name;
+        if( 0 > asprintf(&name, "%s/%s", path, d->d_name) )
+            memory_error();
+        add_name(&ent, name);
+    }
+    closedir(dir);
+    if( ent.count )
+        qsort(ent.names, ent.count, sizeof(char *), cmp_names);
+
+    for( unsigned i = 0; i < ent.count; i++ )
+    {
+        struct stat st;
+        if( stat(ent.names[i], &st) )
+            free(ent.names[i]);
+        else if( S_ISDIR(st.st_mode) )
+        {
+            add_dir(list, ent.names[i]);
+            free(ent.names[i]);
+        }
+        else if( S_ISREG(st.st_mode) && is_image_name(ent.names[i]) )
+            add_name(list, ent.names[i]);
+        else
+            free(ent.names[i]);
+    }
+    free(ent.names);
+}
+
+// Returns the extract path for an image: the image name without the extension,
+// inside the extract path.
+static char *image_ext_dir(const char *atr_name)
+{
+    char buf[PATH_MAX];
+    const char *ext = strrchr(atr_name, '.');
+    const char *sep = strrchr(atr_name, '/');
+    size_t len      = (ext && ext > atr_name && (!sep || ext > sep + 1)) ? ext - atr_name
+                                                                        : strlen(atr_name);
+    char *name = check_malloc(len + 1);
+    memcpy(name, atr_name, len);
+    name[len] = 0;
+    // Skip absolute paths, and use only the file name if the path is not safe.
+    const char *p = name;
+    while( is_separator(*p) )
+        p++;
+    if( !sanitize_path(p, buf, sizeof(buf)) || !*buf )
+    {
+        p = sep ? name + (sep - atr_name) + 1 : name;
+        if( !sanitize_path(p, buf, sizeof(buf)) || !*buf )
+            snprintf(buf, sizeof(buf), "image");
+    }
+    free(name);
+    return strdup(buf);
+}
+
 //---------------------------------------------------------------------
 int main(int argc, char **argv)
 {
-    const char *atr_name = 0;
-    const char *ext_path = 0;
-    int lower_case       = 0;
-    int atari_list       = 0;
-    int extract_files    = 0;
-    int force_overwrite  = 0;
-    int verify_only      = 0;
-    prog_name            = argv[0];
+    struct name_list list = {0};
+    struct ls_opts opt    = {0};
+    const char *ext_path  = 0;
+    enum ls_mode mode     = ls_list;
+    int lazy_load         = 0;
+    int threads           = 0;
+    prog_name             = argv[0];
     for( int i = 1; i < argc; i++ )
     {
         char *arg = argv[i];
         if( !strcmp(arg, "--verify") )
-            verify_only = 1;
+            mode = ls_verify;
+        else if( !strcmp(arg, "--lazy") )
+            lazy_load = 1;
+        else if( !strcmp(arg, "--identify") )
+            mode = ls_identify;
         else if( !strcmp(arg, "--help") )
             show_usage();
         else if( arg[0] == '-' )
@@ -75,21 +441,30 @@ int main(int argc, char **argv)
                 if( op == 'h' || op == '?' )
                     show_usage();
                 else if( op == 'l' )
-                    lower_case = 1;
+                    opt.lower_case = 1;
                 else if( op == 'a' )
-                    atari_list = 1;
+                    opt.atari_list = 1;
                 else if( op == 'x' )
-                    extract_files = 1;
+                    opt.extract_files = 1;
                 else if( op == 'X' )
                 {
                     if( i + 1 >= argc )
                         show_opt_error("option '-X' needs an argument");
                     i++;
-                    extract_files = 1;
-                    ext_path      = argv[i];
+                    opt.extract_files = 1;
+                    ext_path          = argv[i];
+                }
+                else if( op == 'j' )
+                {
+                    if( i + 1 >= argc )
+                        show_opt_error("option '-j' needs an argument");
+                    i++;
+                    threads = atoi(argv[i]);
+                    if( threads < 1 )
+                        show_opt_error("invalid number of threads '%s'", argv[i]);
                 }
                 else if( op == 'f' )
-                    force_overwrite = 1;
+                    opt.force_overwrite = 1;
                 else if( op == 'q' )
                     quiet_mode = 1;
                 else if( op == 'v' )
@@ -98,37 +473,50 @@ int main(int argc, char **argv)
                     show_opt_error("invalid command line option '-%c'", op);
             }
         }
-        else if( !atr_name )
-            atr_name = arg;
         else
-            show_opt_error("multiple ATR files in command line");
+        {
+            struct stat st;
+            if( 0 == stat(arg, &st) && S_ISDIR(st.st_mode) )
+            {
+                unsigned n = list.count;
+                add_dir(&list, arg);
+                if( n == list.count )
+                    show_msg("%s: no ATR images found", arg);
+            }
+            else
+                add_name(&list, strdup(arg));
+        }
     }
-    if( !atr_name )
+    if( !list.count )
         show_opt_error("ATR file name expected");
 
-    if( extract_files && atari_list )
+    if( opt.extract_files && opt.atari_list )
         show_opt_error("options '-x' and '-a' not compatible");
 
-    // Load ATR image file
-    struct atr_image *atr = load_atr_image(atr_name);
-    if( !atr )
-        return 1;
+    struct ls_pool pool = {0};
+    pool.jobs           = check_calloc(list.count, sizeof(struct ls_job));
+    pool.count          = list.count;
+    pool.mode           = mode;
+    pool.lazy_load      = lazy_load;
+    pool.opt            = &opt;
+    for( unsigned i = 0; i < list.count; i++ )
+        pool.jobs[i].atr_name = list.names[i];
 
-    // Verify mode - just check if image loads and is valid
-    if( verify_only )
+    // Open target directory
+    if( ext_path && mode == ls_list )
     {
-        if( atr->sec_count < 1 || (atr->sec_size != 128 && atr->sec_size != 256) )
+        // Images are read after changing the path, so get the full file names
+        char cwd[PATH_MAX];
+        if( !getcwd(cwd, sizeof(cwd)) )
+            show_error("can't get current path: %s", strerror(errno));
+        for( unsigned i = 0; i < list.count; i++ )
         {
-            show_error("%s: invalid ATR image", atr_name);
+            if( !is_separator(list.names[i][0]) &&
+                0 > asprintf(&pool.jobs[i].file_name, "%s/%s", cwd, list.names[i]) )
+                memory_error();
         }
-        printf("%s: ATR image verified - %u sectors of %u bytes\n", atr_name, atr->sec_count,
-               atr->sec_size);
-        atr_free(atr);
-        return 0;
     }
-
-    // Open target directory
-    if( ext_path && chdir(ext_path) )
+    if( ext_path && mode == ls_list && chdir(ext_path) )
     {
         // If path does not exists, check if we can make it
         if( errno == ENOENT )
@@ -142,16 +530,42 @@ int main(int argc, char **argv)
             show_error("%s: invalid extract path, %s", ext_path, strerror(errno));
     }
 
-    int e = sfs_read(atr, atr_name, atari_list, lower_case, extract_files, force_overwrite);
-    if( e )
-        e = howfen_read(atr, atr_name, atari_list, lower_case, extract_files, force_overwrite);
-    if( e )
-        e = dos_read(atr, atr_name, atari_list, lower_case, extract_files, force_overwrite);
-    if( e )
-        e = extra_read(atr, atr_name, atari_list, lower_case, extract_files, force_overwrite);
-    if( e )
-        show_msg("%s: ATR image format not supported.", atr_name);
-    atr_free(atr);
+    // Default to one thread per CPU
+    if( !threads )
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if( threads < 1 )
+            threads = 1;
+    }
 
+    for( unsigned i = 0; i < list.count; i++ )
+    {
+        if( !pool.jobs[i].file_name )
+            pool.jobs[i].file_name = strdup(list.names[i]);
+        if( list.count > 1 && opt.extract_files )
+            pool.jobs[i].ext_dir = image_ext_dir(list.names[i]);
+    }
+
+    int e;
+    if( list.count == 1 )
+    {
+        // Only one image, process directly
+        pool.jobs[0].res.fd = -1;
+        opt.res             = &pool.jobs[0].res;
+        e = read_image(pool.jobs[0].file_name, list.names[0], mode, lazy_load, &opt);
+    }
+    else
+        e = run_pool(&pool, threads);
+
+    for( unsigned i = 0; i < list.count; i++ )
+    {
+        free(pool.jobs[i].file_name);
+        free(pool.jobs[i].ext_dir);
+        free(list.names[i]);
+    }
+    free(pool.jobs);
+    free(list.names);
     return e;
 }
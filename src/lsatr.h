@@ -0,0 +1,43 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Options for the image readers of lsatr.
+ */
+#pragma once
+
+struct atr_image;
+struct sfs_index;
+
+// Resources held while reading one image. The readers keep them here, so that
+// lsatr can release them if show_error() stops the image.
+struct ls_res
+{
+    struct atr_image *atr; // Image being read
+    struct sfs_index *idx; // Directory index of a SpartaDOS image
+    void *data;            // Data of the file being extracted
+    int fd;                // File being extracted, -1 if none
+};
+
+struct ls_opts
+{
+    int atari_list;      // Show listing in Atari instead of UNIX format
+    int lower_case;      // Convert file names to lower-case
+    int extract_files;   // Extract files instead of listing
+    int force_overwrite; // Overwrite existing files when extracting
+    const char *ext_dir; // Extract inside this path instead of the current one
+    struct ls_res *res;  // Resources of the image being read
+};
@@ -38,10 +38,7 @@
 struct lsdos
 {
     struct atr_image *atr;
-    int atari_list;
-    int lower_case;
-    int extract_files;
-    int force_overwrite;
+    const struct ls_opts *opt;
     int dir_size;
     int ldos_csize;
     int fix_bibo;
@@ -86,12 +83,13 @@ static unsigned get_name(char *name, char *aname, const uint8_t *data, int max,
     return l;
 }
 
-// Read up to size bytes from file at given map sector
+// Read up to size bytes from file at given map sector, returns the full file
+// size. If "data" is null, only follows the sector links to get the size.
 static unsigned read_file(struct atr_image *atr, unsigned sect, unsigned size,
                           uint8_t *data, int dos2, int mdos)
 {
     // To avoid circular references, keep a bitmap with all the sectors already used
-    uint8_t *visited = check_calloc(65536, 1);
+    uint8_t *visited = check_calloc(atr->sec_count + 1, 1);
     unsigned lst     = atr->sec_size - 3;
     unsigned pos     = 0;
     unsigned max_iterations = atr->sec_count; // Prevent infinite loops
@@ -131,15 +129,15 @@ static unsigned read_file(struct atr_image *atr, unsigned sect, unsigned size,
             break;
         }
 
-        if( visited[sect & 0xFFFF] )
+        if( visited[sect] )
         {
             show_msg("loop in sector link at sector %d", sect);
             break;
         }
         else
-            visited[sect & 0xFFFF] = 1;
+            visited[sect] = 1;
 
-        if( size > pos )
+        if( data && size > pos )
         {
             unsigned rem = size - pos > len ? len : size - pos;
             memcpy(data + pos, m, rem);
@@ -173,8 +171,8 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
 {
     unsigned ssize = ls->atr->sec_size;
 
-    if( ls->atari_list )
-        printf("Directory of %s\n\n", *name ? name : "/");
+    if( ls->opt->atari_list )
+        fprintf(msg_out(), "Directory of %s\n\n", *name ? name : "/");
 
     for( int fn = 0; fn < ls->dir_size; fn++ )
     {
@@ -190,7 +188,7 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
         if( flags & 0x80 ) // Deleted
             continue;
         char fname[32], aname[32];
-        if( !get_name(fname, aname, entry + 5, 11, ls->lower_case) || !*fname )
+        if( !get_name(fname, aname, entry + 5, 11, ls->opt->lower_case) || !*fname )
         {
             show_msg("%s: invalid file name, skip", name);
             continue;
@@ -210,20 +208,21 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
 
         if( flags == 0x10 )
         {
-            if( ls->extract_files )
+            if( ls->opt->extract_files )
             {
                 struct stat st;
                 const char *path = new_name + 1;
                 // Sanitize path to prevent directory traversal
                 char safe_path[PATH_MAX];
-                if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+                if( !sanitize_path_in(ls->opt->ext_dir, path, safe_path,
+                                      sizeof(safe_path)) )
                 {
                     show_error("%s: dangerous path detected, skipping", path);
                     free(new_name);
                     continue;
                 }
                 path = safe_path;
-                fprintf(stderr, "%s/\n", path);
+                fprintf(msg_err(), "%s/\n", path);
                 // Check if directory already exists:
                 if( stat(path, &st) || !S_ISDIR(st.st_mode) )
                 {
@@ -235,14 +234,14 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
                 // Extract files inside
                 read_dir(ls, sect, new_name);
             }
-            else if( ls->atari_list )
+            else if( ls->opt->atari_list )
             {
                 // Print entry, but don´t recurse
-                printf("%-12s  <DIR>\n", aname);
+                fprintf(msg_out(), "%-12s  <DIR>\n", aname);
             }
             else
             {
-                printf("%8u\t\t%s/\n", size * ssize, new_name);
+                fprintf(msg_out(), "%8u\t\t%s/\n", size * ssize, new_name);
                 read_dir(ls, sect, new_name);
             }
         }
@@ -251,8 +250,11 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
             int mdos       = flags & 0x04;
             int dos2       = flags & 0x02;
             int max_size   = size * ssize;
-            uint8_t *fdata = check_malloc(max_size);
+            uint8_t *fdata = 0;
             unsigned fsize = 0;
+            // Only read the data when extracting, listing just needs the size
+            if( ls->opt->extract_files )
+                fdata = ls->opt->res->data = check_malloc(max_size ? max_size : 1);
             // Skip files of size 0
             if( max_size > 0 )
             {
@@ -260,13 +262,14 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
                 if( fsize > max_size )
                     show_msg("%s: file too long in disk", new_name);
             }
-            if( ls->extract_files )
+            if( ls->opt->extract_files )
             {
                 struct stat st;
                 const char *path = new_name + 1;
                 // Sanitize path to prevent directory traversal
                 char safe_path[PATH_MAX];
-                if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+                if( !sanitize_path_in(ls->opt->ext_dir, path, safe_path,
+                                      sizeof(safe_path)) )
                 {
                     show_error("%s: dangerous path detected, skipping", path);
                     free(fdata);
@@ -274,24 +277,28 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
                     continue;
                 }
                 path = safe_path;
-                fprintf(stderr, "%s\n", path);
+                fprintf(msg_err(), "%s\n", path);
                 // Check if file already exists:
-                if( 0 == stat(path, &st) && !ls->force_overwrite )
+                if( 0 == stat(path, &st) && !ls->opt->force_overwrite )
                     show_error("%s: file already exists. Use -f to overwrite.", path);
                 // Create new file (or truncate if force_overwrite)
-                int fd = ls->force_overwrite ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
-                                             : creat(path, 0666);
+                int fd = ls->opt->force_overwrite
+                             ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                             : creat(path, 0666);
                 if( fd == -1 )
                     show_error("%s: can't create file, %s", path, strerror(errno));
+                ls->opt->res->fd = fd;
                 if( fsize != write(fd, fdata, fsize) )
                     show_error("%s: can't write file, %s", path, strerror(errno));
+                ls->opt->res->fd = -1;
                 if( close(fd) )
                     show_error("%s: can't write file, %s", path, strerror(errno));
             }
-            else if( ls->atari_list )
-                printf("%-12s %7u\n", aname, fsize);
+            else if( ls->opt->atari_list )
+                fprintf(msg_out(), "%-12s %7u\n", aname, fsize);
             else
-                printf("%8u\t\t%s\n", fsize, new_name);
+                fprintf(msg_out(), "%8u\t\t%s\n", fsize, new_name);
+            ls->opt->res->data = 0;
             free(fdata);
         }
         else
@@ -301,9 +308,9 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
         free(new_name);
     }
     // traverse dir again if listing in Atari format, to show sub directories
-    if( ls->atari_list )
+    if( ls->opt->atari_list )
     {
-        printf("\n");
+        fprintf(msg_out(), "\n");
         for( int fn = 0; fn < ls->dir_size; fn++ )
         {
             const uint8_t *data = dir_data(ls, dir, fn);
@@ -318,7 +325,7 @@ static void read_dir(struct lsdos *ls, unsigned dir, const char *name)
                 continue;
 
             char fname[32], aname[32];
-            if( !get_name(fname, aname, entry + 5, 11, ls->lower_case) || !*fname )
+            if( !get_name(fname, aname, entry + 5, 11, ls->opt->lower_case) || !*fname )
                 continue;
             char *new_name;
             int ret = asprintf(&new_name, "%s/%s", name, fname);
@@ -368,8 +375,21 @@ int detect_bibo(struct atr_image *atr, int dir_sect)
     return 0;
 }
 
-int dos_read(struct atr_image *atr, const char *atr_name, int atari_list, int lower_case,
-             int extract_files, int force_overwrite)
+// DOS file system parameters, read from the VTOC
+struct dos_info
+{
+    unsigned alloc_sect;  // Total sectors
+    unsigned free_sect;   // Free sectors
+    unsigned dir_size;    // Entries per directory
+    unsigned ldos_csize;  // LiteDOS cluster size
+    unsigned fix_bibo;    // Fix Bibo-DOS DD directories.
+    const char *dosver;   // DOS name
+    const char *bad_sig;  // Message for corrected bad signature
+};
+
+// Detect the DOS version from the VTOC. Returns 0 if the image has a DOS file
+// system, 1 if not and 2 if the VTOC bitmap is not valid.
+static int dos_detect(struct atr_image *atr, struct dos_info *di)
 {
     // Check DOS filesystem
     // Read VTOC
@@ -385,7 +405,7 @@ int dos_read(struct atr_image *atr, const char *atr_name, int atari_list, int lo
     unsigned dir_size   = 64;       // Entries per directory
     unsigned ldos_csize = 0;        // LiteDOS cluster size
     unsigned fix_bibo   = 0;        // Fix Bibo-DOS DD directories.
-    char *bad_sig       = "";       // Message for corrected bad signature
+    const char *bad_sig = "";       // Message for corrected bad signature
 
     // Calculate signature for MyDOS image format:
     unsigned mydos_sig = 2;
@@ -460,18 +480,9 @@ int dos_read(struct atr_image *atr, const char *atr_name, int atari_list, int lo
         // DOS 1 bitmap should reserve sector 1, DOS 2 reserves 1, 2 and 3
         if( 0 != (bitmap_0 & 0xC0) || (signature == 2 && 0 != (bitmap_0 & 0xF0)) ||
             0 != (bitmap_360 & 0x80) )
-        {
-            show_msg("%s: invalid DOS file system, bitmap not ok.", atr_name);
-            return 1;
-        }
+            return 2;
     }
 
-    if( alloc_sect > atr->sec_count )
-        show_msg("%s: DOS sectors (%d) more than ATR image (%d).", atr_name, alloc_sect,
-                 atr->sec_count);
-    if( free_sect > alloc_sect )
-        show_msg("%s: DOS free sectors more than allocated.", atr_name);
-
     const char *dosver = "DOS 1";
     if( signature == 2 && atr->sec_count > 943 )
         dosver = "DOS 2.5";
@@ -492,29 +503,62 @@ int dos_read(struct atr_image *atr, const char *atr_name, int atari_list, int lo
         fix_bibo = 1;
     }
 
-    if( atari_list )
-        printf("ATR image: %s\n"
-               "Image size: %u sectors of %u bytes\n"
-               "DOS size: %u sectors free of %u total\n"
-               "Volume: %s%s\n",
-               atr_name, atr->sec_count, atr->sec_size, free_sect, alloc_sect, dosver,
-               bad_sig);
+    di->alloc_sect = alloc_sect;
+    di->free_sect  = free_sect;
+    di->dir_size   = dir_size;
+    di->ldos_csize = ldos_csize;
+    di->fix_bibo   = fix_bibo;
+    di->dosver     = dosver;
+    di->bad_sig    = bad_sig;
+    return 0;
+}
+
+int dos_probe(struct atr_image *atr, const char **name)
+{
+    struct dos_info di;
+    if( dos_detect(atr, &di) )
+        return 0;
+    *name = di.dosver;
+    int confidence = *di.bad_sig ? 60 : 90;
+    if( di.alloc_sect > atr->sec_count || di.free_sect > di.alloc_sect )
+        confidence -= 30;
+    return confidence;
+}
+
+int dos_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt)
+{
+    struct dos_info di;
+    int e = dos_detect(atr, &di);
+    if( e == 2 )
+        show_msg("%s: invalid DOS file system, bitmap not ok.", atr_name);
+    if( e )
+        return 1;
+
+    unsigned alloc_sect = di.alloc_sect;
+    unsigned free_sect  = di.free_sect;
+    const char *dosver  = di.dosver;
+    const char *bad_sig = di.bad_sig;
+
+    if( alloc_sect > atr->sec_count )
+        show_msg("%s: DOS sectors (%d) more than ATR image (%d).", atr_name, alloc_sect,
+                 atr->sec_count);
+    if( free_sect > alloc_sect )
+        show_msg("%s: DOS free sectors more than allocated.", atr_name);
+
+    if( opt->atari_list )
+        fprintf(msg_out(), "ATR image: %s\n"
+                "Image size: %u sectors of %u bytes\n"
+                "DOS size: %u sectors free of %u total\n"
+                "Volume: %s%s\n",
+                atr_name, atr->sec_count, atr->sec_size, free_sect, alloc_sect, dosver,
+                bad_sig);
     else
-        printf("%s: %u sectors of %u bytes, %s%s, %d sectors free of %d total.\n",
-               atr_name, atr->sec_count, atr->sec_size, dosver, bad_sig, free_sect,
-               alloc_sect);
-
-    struct lsdos *ls  = check_malloc(sizeof(struct lsdos));
-    ls->atr           = atr;
-    ls->atari_list    = atari_list;
-    ls->lower_case    = lower_case;
-    ls->extract_files = extract_files;
-    ls->force_overwrite = force_overwrite;
-    ls->dir_size      = dir_size;
-    ls->ldos_csize    = ldos_csize;
-    ls->fix_bibo      = fix_bibo;
-    read_dir(ls, 361, "");
-
-    free(ls);
+        fprintf(msg_out(),
+                "%s: %u sectors of %u bytes, %s%s, %d sectors free of %d total.\n",
+                atr_name, atr->sec_count, atr->sec_size, dosver, bad_sig, free_sect,
+                alloc_sect);
+
+    struct lsdos ls = {atr, opt, di.dir_size, di.ldos_csize, di.fix_bibo};
+    read_dir(&ls, 361, "");
     return 0;
 }
@@ -98,15 +98,14 @@ static int check_bas2boot(struct atr_image *atr)
     return 1;
 }
 
-static void extract_bas2boot(struct atr_image *atr, int atari_list, int lower_case,
-                             int extract_files, int force_overwrite)
+static void extract_bas2boot(struct atr_image *atr, const struct ls_opts *opt)
 {
     // Get headers
     const uint8_t *sec1 = atr_data(atr, 1);
     const uint8_t *sec2 = atr_data(atr, 2);
     // Get filename
     char path[32], aname[32];
-    if( !get_name(path, aname, sec2 + 0x60, 12, lower_case) || !*path )
+    if( !get_name(path, aname, sec2 + 0x60, 12, opt->lower_case) || !*path )
     {
         strncpy(path, "noname.bas", sizeof(path) - 1);
         path[sizeof(path) - 1] = '\0';
@@ -116,7 +115,7 @@ static void extract_bas2boot(struct atr_image *atr, int atari_list, int lower_ca
     // Adds '.BAS' if no extension is present
     if( !strchr(path, '.') )
     {
-        const char *ext = lower_case ? ".bas" : ".BAS";
+        const char *ext = opt->lower_case ? ".bas" : ".BAS";
         size_t path_len = strlen(path);
         if( path_len + strlen(ext) < sizeof(path) )
         {
@@ -128,7 +127,7 @@ static void extract_bas2boot(struct atr_image *atr, int atari_list, int lower_ca
 
     // Get data and length
     unsigned fsize = read16(sec1 + 8);
-    uint8_t *fdata = check_malloc(fsize < 16 ? 16 : fsize);
+    uint8_t *fdata = opt->res->data = check_malloc(fsize < 16 ? 16 : fsize);
 
     // Read header and undo bad conversion for certain files
     memcpy(fdata, sec2 + 0x72, 14);
@@ -151,36 +150,39 @@ static void extract_bas2boot(struct atr_image *atr, int atari_list, int lower_ca
             memcpy(fdata + pos, s, len);
     }
 
-    if( extract_files )
+    if( opt->extract_files )
     {
         struct stat st;
         // Sanitize path to prevent directory traversal
         char safe_path[PATH_MAX];
-        if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+        if( !sanitize_path_in(opt->ext_dir, path, safe_path, sizeof(safe_path)) )
         {
             show_error("%s: dangerous path detected, skipping", path);
             free(fdata);
             return;
         }
-        fprintf(stderr, "%s\n", safe_path);
+        fprintf(msg_err(), "%s\n", safe_path);
         // Check if file already exists:
-        if( 0 == stat(safe_path, &st) && !force_overwrite )
+        if( 0 == stat(safe_path, &st) && !opt->force_overwrite )
             show_error("%s: file already exists. Use -f to overwrite.", safe_path);
         // Create new file (or truncate if force_overwrite)
-        int fd = force_overwrite ? open(safe_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
-                                 : creat(safe_path, 0666);
+        int fd = opt->force_overwrite ? open(safe_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                                      : creat(safe_path, 0666);
         if( fd == -1 )
             show_error("%s: can't create file, %s", safe_path, strerror(errno));
+        opt->res->fd = fd;
         if( fsize != write(fd, fdata, fsize) )
             show_error("%s: can't write file, %s", safe_path, strerror(errno));
+        opt->res->fd = -1;
         if( close(fd) )
             show_error("%s: can't write file, %s", safe_path, strerror(errno));
     }
-    else if( atari_list )
-        printf("%-12s %7u\n", aname, fsize);
+    else if( opt->atari_list )
+        fprintf(msg_out(), "%-12s %7u\n", aname, fsize);
     else
-        printf("%8u\t\t%s\n", fsize, path);
+        fprintf(msg_out(), "%8u\t\t%s\n", fsize, path);
 
+    opt->res->data = 0;
     free(fdata);
 }
 
@@ -203,18 +205,18 @@ static int check_kboot(struct atr_image *atr)
     return 0 == memcmp("\x00\x03\x00\x07\x14\x07\x4c\x14\x07", sec, 9);
 }
 
-static void extract_kboot(struct atr_image *atr, const char *atr_name, int atari_list,
-                          int lower_case, int extract_files, int force_overwrite)
+static void extract_kboot(struct atr_image *atr, const char *atr_name,
+                          const struct ls_opts *opt)
 {
 
     const uint8_t *sec = atr_data(atr, 1);
     unsigned fsize     = sec[9] + (sec[10] << 8) + (sec[11] << 16);
     if( !fsize )
     {
-        if( atari_list )
-            printf("<EMPTY>\n");
+        if( opt->atari_list )
+            fprintf(msg_out(), "<EMPTY>\n");
         else
-            printf("%8u\t\t/\n", 0);
+            fprintf(msg_out(), "%8u\t\t/\n", 0);
         return;
     }
     // Get file data
@@ -230,9 +232,11 @@ static void extract_kboot(struct atr_image *atr, const char *atr_name, int atari
         show_msg("%s: data shorter than expected, truncating", atr_name);
         fsize = max_len;
     }
+    // File data is contiguous from sector 4
+    fdata = atr_data_range(atr, 4, (fsize + 127) / 128);
 
     unsigned crc = crc32(0, fdata, fsize);
-    if( extract_files )
+    if( opt->extract_files )
     {
         char *path;
         int ret = asprintf(&path, "kboot-%08x.xex", crc);
@@ -243,63 +247,79 @@ static void extract_kboot(struct atr_image *atr, const char *atr_name, int atari
         }
         // Sanitize path to prevent directory traversal
         char safe_path[PATH_MAX];
-        if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+        if( !sanitize_path_in(opt->ext_dir, path, safe_path, sizeof(safe_path)) )
         {
             show_error("%s: dangerous path detected, skipping", path);
             free(path);
             return;
         }
         struct stat st;
-        fprintf(stderr, "%s\n", safe_path);
+        fprintf(msg_err(), "%s\n", safe_path);
         // Check if file already exists:
-        if( 0 == stat(safe_path, &st) && !force_overwrite )
+        if( 0 == stat(safe_path, &st) && !opt->force_overwrite )
             show_error("%s: file already exists. Use -f to overwrite.", safe_path);
         // Create new file (or truncate if force_overwrite)
-        int fd = force_overwrite ? open(safe_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
-                                 : creat(safe_path, 0666);
+        int fd = opt->force_overwrite ? open(safe_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                                      : creat(safe_path, 0666);
         if( fd == -1 )
             show_error("%s: can't create file, %s", safe_path, strerror(errno));
+        opt->res->fd = fd;
         if( fsize != write(fd, fdata, fsize) )
             show_error("%s: can't write file, %s", safe_path, strerror(errno));
+        opt->res->fd = -1;
         if( close(fd) )
             show_error("%s: can't write file, %s", safe_path, strerror(errno));
         free(path);
     }
-    else if( atari_list )
-        printf("%08X COM %7u\n", crc, fsize);
+    else if( opt->atari_list )
+        fprintf(msg_out(), "%08X COM %7u\n", crc, fsize);
     else
     {
-        printf("%8u\t\t/kboot-%08x.xex\n", fsize, crc);
+        fprintf(msg_out(), "%8u\t\t/kboot-%08x.xex\n", fsize, crc);
     }
 }
 
-static void show_header(struct atr_image *atr, const char *atr_name, int atari_list,
-                        const char *volname)
+static void show_header(struct atr_image *atr, const char *atr_name,
+                        const struct ls_opts *opt, const char *volname)
 {
-    if( atari_list )
-        printf("ATR image: %s\n"
-               "Image size: %u sectors of %u bytes\n"
-               "Volume: %s\n",
-               atr_name, atr->sec_count, atr->sec_size, volname);
+    if( opt->atari_list )
+        fprintf(msg_out(), "ATR image: %s\n"
+                "Image size: %u sectors of %u bytes\n"
+                "Volume: %s\n",
+                atr_name, atr->sec_count, atr->sec_size, volname);
     else
-        printf("%s: %u sectors of %u bytes, %s.\n", atr_name, atr->sec_count,
-               atr->sec_size, volname);
+        fprintf(msg_out(), "%s: %u sectors of %u bytes, %s.\n", atr_name, atr->sec_count,
+                atr->sec_size, volname);
 }
 
-int extra_read(struct atr_image *atr, const char *atr_name, int atari_list,
-               int lower_case, int extract_files, int force_overwrite)
+int extra_probe(struct atr_image *atr, const char **name)
+{
+    if( check_bas2boot(atr) )
+    {
+        *name = "BAS2BOOT";
+        return 95;
+    }
+    else if( check_kboot(atr) )
+    {
+        *name = "K-BOOT";
+        return 80;
+    }
+    return 0;
+}
+
+int extra_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt)
 {
     // Check BAS2BOOT
     if( check_bas2boot(atr) )
     {
-        show_header(atr, atr_name, atari_list, "BAS2BOOT");
-        extract_bas2boot(atr, atari_list, lower_case, extract_files, force_overwrite);
+        show_header(atr, atr_name, opt, "BAS2BOOT");
+        extract_bas2boot(atr, opt);
         return 0;
     }
     else if( check_kboot(atr) )
     {
-        show_header(atr, atr_name, atari_list, "K-BOOT");
-        extract_kboot(atr, atr_name, atari_list, lower_case, extract_files, force_overwrite);
+        show_header(atr, atr_name, opt, "K-BOOT");
+        extract_kboot(atr, atr_name, opt);
         return 0;
     }
 
@@ -19,6 +19,9 @@
  */
 #pragma once
 #include "atr.h"
+#include "lsatr.h"
 
-int extra_read(struct atr_image *atr, const char *atr_name, int atari_list,
-               int lower_case, int extract_files, int force_overwrite);
+// Returns the confidence (0 to 100) of the image having one of the simple boot
+// formats and sets the format name. Only reads the first two sectors.
+int extra_probe(struct atr_image *atr, const char **name);
+int extra_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt);
@@ -25,6 +25,7 @@
 #include "msg.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,19 +75,32 @@ int get_len(const uint8_t *p)
     return len;
 }
 
-int howfen_read(struct atr_image *atr, const char *atr_name, int atari_list,
-                int lower_case, int extract_files, int force_overwrite)
+static int check_howfen(struct atr_image *atr)
 {
     const uint8_t *sec1 = atr_data(atr, 1);
     if( !sec1 )
-        return 1;
+        return 0;
     // Minimal number of sectors is 10
     if( atr->sec_count < 10 )
-        return 1;
+        return 0;
 
     // Check signature: ' HOWFEN DOS ', in internal codes
-    if( memcmp(sec1 + 0x58, "\x80\x28\x2f\x37\x26\x25\x2e\x00\x24\x2f\x33\x00", 12) )
+    return 0 == memcmp(sec1 + 0x58, "\x80\x28\x2f\x37\x26\x25\x2e\x00\x24\x2f\x33\x00", 12);
+}
+
+int howfen_probe(struct atr_image *atr, const char **name)
+{
+    if( !check_howfen(atr) )
+        return 0;
+    *name = "HOWFEN DOS";
+    return 95;
+}
+
+int howfen_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt)
+{
+    if( !check_howfen(atr) )
         return 1;
+    const uint8_t *sec1 = atr_data(atr, 1);
 
     // Get menu version
     char ver[6];
@@ -102,14 +116,14 @@ int howfen_read(struct atr_image *atr, const char *atr_name, int atari_list,
         ver[0] = 0;
     }
 
-    if( atari_list )
-        printf("ATR image: %s\n"
-               "Image size: %u sectors of %u bytes\n"
-               "Volume: HOWFEN DOS %s\n",
-               atr_name, atr->sec_count, atr->sec_size, ver);
+    if( opt->atari_list )
+        fprintf(msg_out(), "ATR image: %s\n"
+                "Image size: %u sectors of %u bytes\n"
+                "Volume: HOWFEN DOS %s\n",
+                atr_name, atr->sec_count, atr->sec_size, ver);
     else
-        printf("%s: %u sectors of %u bytes, HOWFEN DOS %s.\n", atr_name, atr->sec_count,
-               atr->sec_size, ver);
+        fprintf(msg_out(), "%s: %u sectors of %u bytes, HOWFEN DOS %s.\n", atr_name,
+                atr->sec_count, atr->sec_size, ver);
 
     // This is the actual tables in the loader:
     // $89 + N*$20 : line with letter, name and size
@@ -135,7 +149,7 @@ int howfen_read(struct atr_image *atr, const char *atr_name, int atari_list,
             // Get file size
             int slen = get_len(pos + 0x1B);
             // Check filename
-            if( get_name(fname, aname, pos + 2, 25, lower_case) )
+            if( get_name(fname, aname, pos + 2, 25, opt->lower_case) )
             {
                 // Get sector number
                 uint16_t snum = sec1[0x32A + i] + (sec1[0x33E + i] << 8);
@@ -159,27 +173,36 @@ int howfen_read(struct atr_image *atr, const char *atr_name, int atari_list,
                     slen = 0;
                 }
                 unsigned fsize = slen * atr->sec_size;
-                if( extract_files )
+                if( opt->extract_files )
                 {
+                    // Get all the file sectors at once
+                    if( slen > 0 )
+                        fdata = atr_data_range(atr, snum, slen);
                     struct stat st;
-                    fprintf(stderr, "%s\n", fname);
+                    char path[PATH_MAX];
+                    if( !sanitize_path_in(opt->ext_dir, fname, path, sizeof(path)) )
+                        show_error("%s: dangerous path detected, skipping", fname);
+                    fprintf(msg_err(), "%s\n", path);
                     // Check if file already exists:
-                    if( 0 == stat(fname, &st) && !force_overwrite )
-                        show_error("%s: file already exists. Use -f to overwrite.", fname);
+                    if( 0 == stat(path, &st) && !opt->force_overwrite )
+                        show_error("%s: file already exists. Use -f to overwrite.", path);
                     // Create new file (or truncate if force_overwrite)
-                    int fd = force_overwrite ? open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)
-                                             : creat(fname, 0666);
+                    int fd = opt->force_overwrite
+                                 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                                 : creat(path, 0666);
                     if( fd == -1 )
-                        show_error("%s: can't create file, %s", fname, strerror(errno));
+                        show_error("%s: can't create file, %s", path, strerror(errno));
+                    opt->res->fd = fd;
                     if( fsize != write(fd, fdata, fsize) )
-                        show_error("%s: can't write file, %s", fname, strerror(errno));
+                        show_error("%s: can't write file, %s", path, strerror(errno));
+                    opt->res->fd = -1;
                     if( close(fd) )
-                        show_error("%s: can't write file, %s", fname, strerror(errno));
+                        show_error("%s: can't write file, %s", path, strerror(errno));
                 }
-                else if( atari_list )
-                    printf("%-20s %7u\n", aname, fsize);
+                else if( opt->atari_list )
+                    fprintf(msg_out(), "%-20s %7u\n", aname, fsize);
                 else
-                    printf("%8u\t\t/%s\n", fsize, fname);
+                    fprintf(msg_out(), "%8u\t\t/%s\n", fsize, fname);
             }
         }
         else
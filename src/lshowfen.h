@@ -19,6 +19,9 @@
  */
 #pragma once
 #include "atr.h"
+#include "lsatr.h"
 
-int howfen_read(struct atr_image *atr, const char *atr_name, int atari_list, int lower_case,
-                int extract_files, int force_overwrite);
+// Returns the confidence (0 to 100) of the image being a HOWFEN menu disk and
+// sets the format name. Only reads the first sector.
+int howfen_probe(struct atr_image *atr, const char **name);
+int howfen_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt);
@@ -22,6 +22,7 @@
 #include "atr.h"
 #include "compat.h"
 #include "msg.h"
+#include "sfsdir.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -38,10 +39,7 @@
 struct lssfs
 {
     struct atr_image *atr;
-    int atari_list;
-    int lower_case;
-    int extract_files;
-    int force_overwrite;
+    const struct ls_opts *opt;
 };
 
 //---------------------------------------------------------------------
@@ -50,11 +48,6 @@ static uint16_t read16(const uint8_t *p)
     return p[0] | (p[1] << 8);
 }
 
-static unsigned read24(const uint8_t *p)
-{
-    return p[0] | (p[1] << 8) | (p[2] << 16);
-}
-
 // Get maximum size of file at given map sector
 static unsigned file_msize(struct atr_image *atr, unsigned map)
 {
@@ -93,102 +86,6 @@ static unsigned file_msize(struct atr_image *atr, unsigned map)
     return size;
 }
 
-// Read up to size bytes from file at given map sector
-static unsigned read_file(struct atr_image *atr, unsigned map, unsigned size,
-                          uint8_t *data)
-{
-    const uint8_t *m = atr_data(atr, map);
-    unsigned s       = 4;
-    unsigned pos     = 0;
-    if( map < 2 || !m )
-    {
-        show_msg("invalid sector map");
-        return 0;
-    }
-
-    unsigned visited_count = 0;
-    const unsigned max_visited = atr->sec_count; // Prevent infinite loops
-    while( size && visited_count < max_visited )
-    {
-        if( s >= atr->sec_size )
-        {
-            // next map
-            unsigned next_map = read16(m);
-            if( !next_map )
-                return pos;
-            if( next_map < 2 || next_map > atr->sec_count )
-            {
-                show_msg("invalid next sector map");
-                return pos;
-            }
-            map = next_map;
-            m = atr_data(atr, map);
-            if( !m )
-            {
-                show_msg("invalid next sector map");
-                return pos;
-            }
-            s = 4;
-            visited_count++;
-        }
-        unsigned rem = size > atr->sec_size ? atr->sec_size : size;
-        unsigned sec = read16(m + s);
-        s += 2;
-        if( !sec )
-            memset(data + pos, 0, rem);
-        else if( sec < 2 || sec > atr->sec_count )
-        {
-            show_msg("invalid data sector %u", sec);
-            return pos;
-        }
-        else
-        {
-            const uint8_t *sec_data = atr_data(atr, sec);
-            if( !sec_data )
-            {
-                show_msg("invalid data sector %u", sec);
-                return pos;
-            }
-            memcpy(data + pos, sec_data, rem);
-        }
-        pos += rem;
-        size -= rem;
-    }
-    if( visited_count >= max_visited )
-        show_msg("sector map chain too long, possible loop");
-    return pos;
-}
-
-// Read data and write a UNIX filename and an "Atari" filename.
-static unsigned get_name(char *name, char *aname, const uint8_t *data, int max,
-                         int lower_case)
-{
-    unsigned l = 0;
-    int dot    = 0;
-    memset(aname, ' ', max + 1);
-    aname[max + 1] = 0;
-    for( int i = 0; i < max; i++ )
-    {
-        uint8_t c = data[i];
-        if( c >= 'A' && c <= 'Z' && lower_case )
-            c = c - 'A' + 'a';
-        if( c < ' ' || c == '/' || c == '.' || c == '?' || c == '\\' || c == 96 ||
-            c > 'z' )
-            c = '_';
-        else if( c == ' ' )
-            continue;
-        if( i > 7 && !dot )
-        {
-            dot       = 1;
-            name[l++] = '.';
-        }
-        name[l++]      = c;
-        aname[i + dot] = c;
-    }
-    name[l] = 0;
-    return l;
-}
-
 static void set_times(const char *path, int d_day, int d_mon, int d_yea, int t_hh,
                       int t_mm, int t_ss)
 {
@@ -206,47 +103,24 @@ static void set_times(const char *path, int d_day, int d_mon, int d_yea, int t_h
     utime(path, &tb);
 }
 
-static void read_dir(struct lssfs *ls, unsigned map, const char *name)
+static void read_dir(struct lssfs *ls, const struct sfs_entry *dir, const char *name)
 {
-    if( ls->atari_list )
-        printf("Directory of %s\n\n", *name ? name : "/");
+    if( ls->opt->atari_list )
+        fprintf(msg_out(), "Directory of %s\n\n", *name ? name : "/");
 
-    uint8_t *data = check_malloc(65536); // max directory size (2848 entries)
-    unsigned len  = read_file(ls->atr, map, 65536, data);
-    if( !len )
+    // traverse dir, the entries are already read in the index
+    for( const struct sfs_entry *e = dir->child; e; e = e->next )
     {
-        show_msg("%s: can't get directory data", name);
-        free(data);
-        return;
-    }
-    else if( len == 65536 )
-        show_msg("%s: directory too big", name);
-
-    // traverse dir
-    for( unsigned i = 23; i < len; i += 23 )
-    {
-        unsigned flags = data[i];
-        if( !flags )
-            break; // no more entries
-        if( 0 == (flags & 0x08) )
-            continue; // unused
-        if( 0x10 == (flags & 0x10) )
-            continue; // erased
-        int is_dir     = flags & 0x20;
-        unsigned fmap  = read16(data + i + 1);
-        unsigned fsize = read24(data + i + 3);
-        int fd_day     = data[i + 17];
-        int fd_mon     = data[i + 18];
-        int fd_yea     = data[i + 19];
-        int ft_hh      = data[i + 20];
-        int ft_mm      = data[i + 21];
-        int ft_ss      = data[i + 22];
+        int is_dir     = e->flags & 0x20;
+        unsigned fsize = e->size;
+        int fd_day     = e->date[0];
+        int fd_mon     = e->date[1];
+        int fd_yea     = e->date[2];
+        int ft_hh      = e->time[0];
+        int ft_mm      = e->time[1];
+        int ft_ss      = e->time[2];
         char fname[32], aname[32];
-        if( !get_name(fname, aname, data + i + 6, 11, ls->lower_case) || !*fname )
-        {
-            show_msg("%s: invalid file name, skip", name);
-            continue;
-        }
+        sfs_get_name(fname, aname, e->aname, 11, ls->opt->lower_case);
         char *new_name;
         int ret = asprintf(&new_name, "%s/%s", name, fname);
         if( ret < 0 )
@@ -256,20 +130,21 @@ static void read_dir(struct lssfs *ls, unsigned map, const char *name)
         }
         if( is_dir )
         {
-            if( ls->extract_files )
+            if( ls->opt->extract_files )
             {
                 struct stat st;
                 const char *path = new_name + 1;
                 // Sanitize path to prevent directory traversal
                 char safe_path[PATH_MAX];
-                if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+                if( !sanitize_path_in(ls->opt->ext_dir, path, safe_path,
+                                      sizeof(safe_path)) )
                 {
                     show_error("%s: dangerous path detected, skipping", path);
                     free(new_name);
                     continue;
                 }
                 path = safe_path;
-                fprintf(stderr, "%s/\n", path);
+                fprintf(msg_err(), "%s/\n", path);
                 // Check if directory already exists:
                 if( stat(path, &st) || !S_ISDIR(st.st_mode) )
                 {
@@ -279,89 +154,83 @@ static void read_dir(struct lssfs *ls, unsigned map, const char *name)
                                    strerror(errno));
                 }
                 // Extract files inside
-                read_dir(ls, fmap, new_name);
+                read_dir(ls, e, new_name);
                 // Set time/date
                 set_times(path, fd_day, fd_mon, fd_yea, ft_hh, ft_mm, ft_ss);
             }
-            else if( ls->atari_list )
+            else if( ls->opt->atari_list )
             {
                 // Print entry, but don´t recurse
-                printf("%-12s  <DIR>  %02d-%02d-%02d %02d:%02d\n", aname, fd_day, fd_mon,
-                       fd_yea, ft_hh, ft_mm);
+                fprintf(msg_out(), "%-12s  <DIR>  %02d-%02d-%02d %02d:%02d\n", aname, fd_day,
+                        fd_mon, fd_yea, ft_hh, ft_mm);
             }
             else
             {
-                unsigned dirsz = file_msize(ls->atr, fmap);
-                printf("%8u\t%02d-%02d-%02d %02d:%02d:%02d\t%s/\n", dirsz, fd_day, fd_mon,
-                       fd_yea, ft_hh, ft_mm, ft_ss, new_name);
-                read_dir(ls, fmap, new_name);
+                unsigned dirsz = file_msize(ls->atr, e->map);
+                fprintf(msg_out(), "%8u\t%02d-%02d-%02d %02d:%02d:%02d\t%s/\n", dirsz,
+                        fd_day, fd_mon, fd_yea, ft_hh, ft_mm, ft_ss, new_name);
+                read_dir(ls, e, new_name);
             }
         }
         else
         {
-            uint8_t *fdata = check_malloc(fsize);
-            unsigned r     = read_file(ls->atr, fmap, fsize, fdata);
-            if( r != fsize )
-                show_msg("%s: short file in disk", new_name);
-            if( ls->extract_files )
+            if( ls->opt->extract_files )
             {
                 struct stat st;
                 const char *path = new_name + 1;
                 // Sanitize path to prevent directory traversal
                 char safe_path[PATH_MAX];
-                if( !sanitize_path(path, safe_path, sizeof(safe_path)) )
+                if( !sanitize_path_in(ls->opt->ext_dir, path, safe_path,
+                                      sizeof(safe_path)) )
                 {
                     show_error("%s: dangerous path detected, skipping", path);
-                    free(fdata);
                     free(new_name);
                     continue;
                 }
                 path = safe_path;
-                fprintf(stderr, "%s\n", path);
+                fprintf(msg_err(), "%s\n", path);
                 // Check if file already exists:
-                if( 0 == stat(path, &st) && !ls->force_overwrite )
+                if( 0 == stat(path, &st) && !ls->opt->force_overwrite )
                     show_error("%s: file already exists. Use -f to overwrite.", path);
                 // Create new file (or truncate if force_overwrite)
-                int fd = ls->force_overwrite ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
-                                              : creat(path, 0666);
+                int fd = ls->opt->force_overwrite
+                             ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+                             : creat(path, 0666);
                 if( fd == -1 )
                     show_error("%s: can't create file, %s", path, strerror(errno));
-                if( fsize != write(fd, fdata, fsize) )
+                ls->opt->res->fd = fd;
+                // Write directly from the image data
+                unsigned r;
+                if( sfs_write_file(ls->atr, e->map, fsize, fd, &r) )
                     show_error("%s: can't write file, %s", path, strerror(errno));
+                if( r != fsize )
+                    show_msg("%s: short file in disk", new_name);
+                ls->opt->res->fd = -1;
                 if( close(fd) )
                     show_error("%s: can't write file, %s", path, strerror(errno));
                 // Set time/date
                 set_times(path, fd_day, fd_mon, fd_yea, ft_hh, ft_mm, ft_ss);
             }
-            else if( ls->atari_list )
-                printf("%-12s %7u %02d-%02d-%02d %02d:%02d\n", aname, fsize, fd_day,
-                       fd_mon, fd_yea, ft_hh, ft_mm);
+            // The size in the entry is exact, so listing does not read the file
+            else if( ls->opt->atari_list )
+                fprintf(msg_out(), "%-12s %7u %02d-%02d-%02d %02d:%02d\n", aname, fsize,
+                        fd_day, fd_mon, fd_yea, ft_hh, ft_mm);
             else
-                printf("%8u\t%02d-%02d-%02d %02d:%02d:%02d\t%s\n", fsize, fd_day, fd_mon,
-                       fd_yea, ft_hh, ft_mm, ft_ss, new_name);
-            free(fdata);
+                fprintf(msg_out(), "%8u\t%02d-%02d-%02d %02d:%02d:%02d\t%s\n", fsize,
+                        fd_day, fd_mon, fd_yea, ft_hh, ft_mm, ft_ss, new_name);
         }
         free(new_name);
     }
     // traverse dir again if listing in Atari format, to show sub directories
-    if( ls->atari_list )
+    if( ls->opt->atari_list )
     {
-        printf("\n");
-        for( unsigned i = 23; i < len; i += 23 )
+        fprintf(msg_out(), "\n");
+        for( const struct sfs_entry *e = dir->child; e; e = e->next )
         {
-            unsigned flags = data[i];
-            if( !flags )
-                break; // no more entries
-            if( 0 == (flags & 0x08) )
-                continue; // unused
-            if( 0x10 == (flags & 0x10) )
-                continue; // erased
-            if( 0 == (flags & 0x20) )
+            if( 0 == (e->flags & 0x20) )
                 continue; // not directory
-            unsigned fmap = read16(data + i + 1);
             char fname[32], aname[32];
-            if( !get_name(fname, aname, data + i + 6, 11, ls->lower_case) )
-                continue;
+            sfs_get_name(fname, aname, e->aname, 11, ls->opt->lower_case);
             char *new_name;
             int ret = asprintf(&new_name, "%s/%s", name, fname);
             if( ret < 0 )
@@ -369,15 +238,29 @@ static void read_dir(struct lssfs *ls, unsigned map, const char *name)
                 show_error("memory error allocating path name");
                 continue;
             }
-            read_dir(ls, fmap, new_name);
+            read_dir(ls, e, new_name);
             free(new_name);
         }
     }
-    free(data);
 }
 
-int sfs_read(struct atr_image *atr, const char *atr_name, int atari_list, int lower_case,
-             int extract_files, int force_overwrite)
+int sfs_probe(struct atr_image *atr, const char **name)
+{
+    // Same checks as sfs_read, without messages
+    const uint8_t *boot  = atr_data(atr, 1);
+    unsigned rootdir_map = read16(boot + 9);
+    unsigned num_sect    = read16(boot + 11);
+    unsigned bitmap_sect = read16(boot + 16);
+    unsigned sector_size = boot[31] ? boot[31] : 256;
+    if( boot[7] != 0x80 || sector_size != atr->sec_size || atr->sec_count < 6 ||
+        rootdir_map < 2 || rootdir_map > atr->sec_count || bitmap_sect < 2 ||
+        bitmap_sect > atr->sec_count )
+        return 0;
+    *name = "SpartaDOS";
+    return num_sect == atr->sec_count ? 95 : 70;
+}
+
+int sfs_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt)
 {
     // Check SFS filesystem
     // Read superblock
@@ -388,7 +271,7 @@ int sfs_read(struct atr_image *atr, const char *atr_name, int atari_list, int lo
     unsigned bitmap_sect = read16(boot + 16);
     unsigned sector_size = boot[31] ? boot[31] : 256;
     char vol_name[32], aname[32];
-    if( !get_name(vol_name, aname, boot + 22, 8, lower_case) )
+    if( !sfs_get_name(vol_name, aname, boot + 22, 8, opt->lower_case) )
         vol_name[0] = 0;
 
     if( signature != 0x80 )
@@ -421,23 +304,24 @@ int sfs_read(struct atr_image *atr, const char *atr_name, int atari_list, int lo
         return 1;
     }
 
-    if( atari_list )
-        printf("ATR image: %s\n"
-               "Image size: %u sectors of %u bytes\n"
-               "Volume Name: %s\n",
-               atr_name, atr->sec_count, atr->sec_size, *vol_name ? vol_name : "NONE");
+    if( opt->atari_list )
+        fprintf(msg_out(), "ATR image: %s\n"
+                "Image size: %u sectors of %u bytes\n"
+                "Volume Name: %s\n",
+                atr_name, atr->sec_count, atr->sec_size, *vol_name ? vol_name : "NONE");
     else
-        printf("%s: %u sectors of %u bytes, volume name '%s'.\n", atr_name,
-               atr->sec_count, atr->sec_size, vol_name);
+        fprintf(msg_out(), "%s: %u sectors of %u bytes, volume name '%s'.\n", atr_name,
+                atr->sec_count, atr->sec_size, vol_name);
+
+    struct sfs_index *idx = sfs_index_load(atr);
+    if( !idx )
+        return 1;
+    opt->res->idx = idx;
 
-    struct lssfs *ls  = check_malloc(sizeof(struct lssfs));
-    ls->atr           = atr;
-    ls->atari_list    = atari_list;
-    ls->lower_case    = lower_case;
-    ls->extract_files = extract_files;
-    ls->force_overwrite = force_overwrite;
-    read_dir(ls, rootdir_map, "");
+    struct lssfs ls = {atr, opt};
+    read_dir(&ls, sfs_index_root(idx), "");
 
-    free(ls);
+    opt->res->idx = 0;
+    sfs_index_free(idx);
     return 0;
 }
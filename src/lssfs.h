@@ -19,6 +19,9 @@
  */
 #pragma once
 #include "atr.h"
+#include "lsatr.h"
 
-int sfs_read(struct atr_image *atr, const char *atr_name, int atari_list, int lower_case,
-             int extract_files, int force_overwrite);
+// Returns the confidence (0 to 100) of the image having a SpartaDOS file system
+// and sets the DOS name. Only reads the boot sector.
+int sfs_probe(struct atr_image *atr, const char **name);
+int sfs_read(struct atr_image *atr, const char *atr_name, const struct ls_opts *opt);
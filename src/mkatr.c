@@ -17,6 +17,7 @@
 /*
  * Creates an ATR with the given files as contents.
  */
+#include "atrwrite.h"
 #include "disksizes.h"
 #include "flist.h"
 #include "modatr.h"
@@ -41,6 +42,12 @@ static void show_usage(void)
            "\t-B page\tRelocate the bootloader to this page address. Please, read\n"
            "\t       \tthe documentation before using this option.\n"
            "\t--to-atascii\tConvert files from UTF8 to ATASCII when adding to ATR.\n"
+           "\t--sparse\tWrite empty sectors as holes, making a sparse file.\n"
+           "\t--contiguous\tStore the main directory and boot file first, and each\n"
+           "\t            \tfile contiguous, for faster loading.\n"
+           "\t--load-order file\n"
+           "\t            \tStore the files listed, one full path per line, first\n"
+           "\t            \tin the given order. Implies --contiguous.\n"
            "\t-h\tShow this help.\n"
            "\t-v\tShow version information.\n"
            "\n"
@@ -52,7 +59,7 @@ static void show_usage(void)
     exit(EXIT_SUCCESS);
 }
 
-static void write_atr(const char *out, const uint8_t *data, int ssec, int nsec)
+static void write_atr(const char *out, const uint8_t *const *sect, int ssec, int nsec)
 {
     // Check for overflow in size calculation
     int size;
@@ -76,39 +83,36 @@ static void write_atr(const char *out, const uint8_t *data, int ssec, int nsec)
     }
     show_msg("writing image with %d sectors of %d bytes, total %d bytes.", nsec, ssec,
              size);
-    FILE *f = fopen(out, "wb");
-    if( !f )
-        show_error("can't open output file '%s': %s", out, strerror(errno));
-    putc(0x96, f);
-    putc(0x02, f);
-    putc(size >> 4, f);
-    putc(size >> 12, f);
-    putc(ssec, f);
-    putc(ssec >> 8, f);
-    putc(size >> 20, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
-    putc(0, f);
+    atr_write_sectors(out, ssec, nsec, sect);
+}
 
-    for( int i = 0; i < nsec; i++ )
+typedef darray(char *) name_list;
+
+// Reads the load order hint list, one path per line, skipping empty lines and
+// comments starting with '#'.
+static void read_load_order(const char *fname, name_list *order)
+{
+    FILE *f = fopen(fname, "r");
+    if( !f )
+        show_error("can't open load order list '%s': %s", fname, strerror(errno));
+    char line[PATH_MAX + 2];
+    for( unsigned num = 1; fgets(line, sizeof(line), f); num++ )
     {
-        // First three sectors are 128 bytes
-        size_t write_size = (i < 3) ? 128 : ssec;
-        if( fwrite(data + ssec * i, write_size, 1, f) != 1 )
-        {
-            fclose(f);
-            show_error("can't write sector %d to output file '%s': %s", i + 1, out,
-                       strerror(errno));
-        }
+        // A full buffer without the newline is valid only at the end of file
+        size_t len = strlen(line);
+        if( len == sizeof(line) - 1 && line[len - 1] != '\n' && fgetc(f) != EOF )
+            show_error("%s:%u: line too long", fname, num);
+        char *p = line, *e = line + len;
+        while( *p == ' ' || *p == '\t' )
+            p++;
+        while( e > p && (e[-1] == '\n' || e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t') )
+            e--;
+        *e = 0;
+        if( *p && *p != '#' )
+            darray_add(order, strdup(p));
     }
-    if( 0 != fclose(f) )
-        show_error("can't write output file '%s': %s", out, strerror(errno));
+    if( ferror(f) || fclose(f) )
+        show_error("can't read load order list '%s': %s", fname, strerror(errno));
 }
 
 // Get image size given number of sectors and sector size, taking account for
@@ -173,6 +177,7 @@ int main(int argc, char **argv)
     int min_size       = 0;                      // Minimum image size
     int add_mode       = 0;                      // Add to existing ATR
     int to_atascii     = 0;                      // Convert UTF8 to ATASCII
+    int contiguous     = 0;                      // Seek-optimized layout
     const int max_size = image_size(65535, 256); // Maximum image size
 
     prog_name = argv[0];
@@ -180,6 +185,8 @@ int main(int argc, char **argv)
     file_list flist;
     darray_init(flist, 1);
     flist_add_main_dir(&flist);
+    name_list order;
+    darray_init(order, 1);
 
     for( i = 1; i < argc; i++ )
     {
@@ -188,6 +195,22 @@ int main(int argc, char **argv)
         {
             to_atascii = 1;
         }
+        else if( !strcmp(arg, "--sparse") )
+        {
+            atr_write_set_sparse(1);
+        }
+        else if( !strcmp(arg, "--contiguous") )
+        {
+            contiguous = 1;
+        }
+        else if( !strcmp(arg, "--load-order") )
+        {
+            if( i + 1 >= argc )
+                show_opt_error("option '--load-order' needs an argument");
+            i++;
+            read_load_order(argv[i], &order);
+            contiguous = 1;
+        }
         else if( arg[0] == '-' )
         {
             char op;
@@ -271,6 +294,19 @@ int main(int argc, char **argv)
     if( to_atascii )
         flist_set_convert_utf8_to_atascii(1);
 
+    // Read all the files
+    flist_load(&flist);
+
+    // Select the layout of the new image
+    sfs_set_layout(contiguous, (const char *const *)&darray_i(&order, 0), darray_len(&order),
+                   &flist);
+    char **name;
+    darray_foreach(name, &order)
+    {
+        free(*name);
+    }
+    darray_delete(order);
+
     // Check if adding to existing file
     if( add_mode )
     {
@@ -292,57 +328,58 @@ int main(int argc, char **argv)
                 darray_add(&new_files, af);
         }
         int ret = modatr_add_files(out, &new_files);
-        darray_delete(flist);
         darray_delete(new_files);
+        flist_free(&flist);
         return ret;
     }
 
     struct sfs *sfs = 0;
     if( exact_size )
     {
-        // Try biggest size and the try reducing:
+        // Get the smallest image holding all files, using 128 byte sectors if possible
+        int ssec = 128;
+        int nsec = -1;
         if( min_size <= image_size(65535, 128) )
-            sfs = build_spartafs(128, 65535, boot_addr, &flist);
-        if( !sfs )
-            sfs = build_spartafs(256, 65535, boot_addr, &flist);
-        if( sfs )
+            nsec = sfs_plan(ssec, &flist);
+        if( nsec < 0 )
+        {
+            ssec = 256;
+            nsec = sfs_plan(ssec, &flist);
+        }
+        if( nsec > 0 )
         {
-            int nsec = 65535 - sfs_get_free_sectors(sfs);
-            int ssec = sfs_get_sector_size(sfs);
-
             if( image_size(nsec, ssec) < min_size )
                 nsec = image_sect(min_size, ssec);
-
-            for( ; nsec > 5 && image_size(nsec, ssec) >= min_size; nsec-- )
-            {
-                struct sfs *n = build_spartafs(ssec, nsec, boot_addr, &flist);
-                if( !n )
-                    break;
-                sfs_free(sfs);
-                sfs = n;
-                if( sfs_get_free_sectors(sfs) > 0 &&
-                    image_size(nsec - 1, ssec) > min_size )
-                {
-                    nsec = nsec - sfs_get_free_sectors(sfs) + 1;
-                    if( image_size(nsec, ssec) < min_size )
-                        nsec = 1 + image_sect(min_size, ssec);
-                }
-            }
+            sfs = build_spartafs(ssec, nsec, boot_addr, &flist);
         }
     }
     else
     {
-        for( i = 0; !sfs && sectors[i].size; i++ )
+        // Show the space left in each standard size, build the smallest that fits
+        int sel = -1;
+        for( i = 0; sectors[i].size; i++ )
         {
-            if( image_size(sectors[i].size, sectors[i].num) < min_size )
+            int ssec = sectors[i].size, nsec = sectors[i].num;
+            if( image_size(nsec, ssec) < min_size )
                 continue;
-            sfs = build_spartafs(sectors[i].size, sectors[i].num, boot_addr, &flist);
+            int nfree = sfs_plan_free(ssec, nsec, &flist);
+            if( nfree < 0 )
+                show_msg("%5d sectors of %d bytes: too small, %d sectors missing.", nsec,
+                         ssec, -nfree);
+            else
+                show_msg("%5d sectors of %d bytes: %d sectors free (%d bytes).", nsec,
+                         ssec, nfree, nfree * ssec);
+            if( sel < 0 && nfree >= 0 )
+                sel = i;
         }
+        if( sel >= 0 )
+            sfs = build_spartafs(sectors[sel].size, sectors[sel].num, boot_addr, &flist);
     }
-    if( sfs )
-        write_atr(out, sfs_get_data(sfs), sfs_get_sector_size(sfs),
-                  sfs_get_num_sectors(sfs));
-    else
+    if( !sfs )
         show_error("can't create an image big enough.");
+    write_atr(out, sfs_get_sectors(sfs), sfs_get_sector_size(sfs), sfs_get_num_sectors(sfs));
+    sfs_free(sfs);
+    flist_free(&flist);
+    sfs_set_layout(0, 0, 0, 0);
     return 0;
 }
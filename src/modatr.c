@@ -20,100 +20,677 @@
 #include "modatr.h"
 #include "atr.h"
 #include "flist.h"
-#include "spartafs.h"
 #include "msg.h"
-#include <errno.h>
+#include "secmap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
-// Add files to an existing ATR image
-int modatr_add_files(const char *atr_file, file_list *flist)
+static unsigned read16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned read24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static void put16(uint8_t *p, unsigned x)
+{
+    p[0] = x & 0xFF;
+    p[1] = x >> 8;
+}
+
+static void put24(uint8_t *p, unsigned x)
 {
-    // Load existing ATR
-    struct atr_image *atr = load_atr_image(atr_file);
+    p[0] = x & 0xFF;
+    p[1] = (x >> 8) & 0xFF;
+    p[2] = x >> 16;
+}
+
+struct sdir;
+
+// SpartaDOS image opened for modification. All changes are made to the sectors
+// of the writable image and written with atr_commit(), only the modified ones:
+// first the file data and sector maps, then the directories and last the
+// bitmap and boot sector, so that an interrupted write leaves the old files
+// intact. Sectors freed are not reused until the disk is full, as the old
+// directories on disk still point to them.
+struct simg
+{
+    struct atr_image *atr;
+    const char *name;
+    unsigned ssz;        // Sector size
+    unsigned slots;      // Data sectors in each sector map
+    unsigned bmap;       // First bitmap sector
+    unsigned nbmp;       // Number of bitmap sectors
+    unsigned next;       // Next sector to allocate
+    unsigned root;       // Main directory sector map
+    struct secmap free;  // Free sectors
+    struct secmap freed; // Sectors freed since the image was opened
+    uint8_t *bmp;        // Bitmap as stored in the image
+    darray(struct sdir *) dirs; // Loaded directories
+};
+
+// Directory loaded in memory
+struct sdir
+{
+    const struct afile *af;   // Directory added from the file list, if any
+    struct sdir *parent;      // Parent directory, null for the main directory
+    unsigned pos;             // Position of the entry in the parent directory
+    unsigned size;            // Size from the header
+    uint8_t *data;            // Data of all sectors
+    darray(unsigned) maps;    // Sector maps
+    darray(unsigned) sect;    // Data sectors
+};
+
+// Opens the image for modification, reading the free sector bitmap.
+static int simg_open(struct simg *img, const char *atr_file)
+{
+    struct atr_image *atr = atr_open(atr_file, atr_load_write);
     if( !atr )
         return 1;
 
     // Check if it's a SpartaDOS filesystem
     const uint8_t *boot = atr_data(atr, 1);
-    if( !boot || boot[7] != 0x80 )
+    unsigned ssz        = boot && boot[31] ? boot[31] : 256;
+    unsigned nsec       = boot ? read16(boot + 11) : 0;
+    unsigned bmap       = boot ? read16(boot + 16) : 0;
+    unsigned nbmp       = boot ? boot[15] : 0;
+    if( !boot || boot[7] != 0x80 || ssz != atr->sec_size || atr->sec_count < 6 )
     {
-        show_error("%s: only SpartaDOS/BW-DOS images can be modified", atr_file);
+        show_msg("%s: only SpartaDOS/BW-DOS images can be modified", atr_file);
         atr_free(atr);
         return 1;
     }
-
-    // Create backup filename
-    char *backup_file = check_malloc(strlen(atr_file) + 10);
-    strcpy(backup_file, atr_file);
-    strcat(backup_file, ".bak");
-
-    // Copy original to backup
-    FILE *src = fopen(atr_file, "rb");
-    if( !src )
+    if( nsec != atr->sec_count || bmap < 4 || !nbmp || bmap + nbmp - 1 > nsec ||
+        nbmp * ssz * 8 < nsec + 1 )
     {
-        show_error("can't open '%s' for reading: %s", atr_file, strerror(errno));
-        free(backup_file);
+        show_msg("%s: invalid SpartaDOS file system, can't modify", atr_file);
         atr_free(atr);
         return 1;
     }
 
-    FILE *dst = fopen(backup_file, "wb");
-    if( !dst )
+    img->atr   = atr;
+    img->name  = atr_file;
+    img->ssz   = ssz;
+    img->slots = (ssz - 4) / 2;
+    img->bmap  = bmap;
+    img->nbmp  = nbmp;
+    img->root  = read16(boot + 9);
+    img->next  = read16(boot + 18);
+    if( img->next <= bmap + nbmp || img->next > nsec )
+        img->next = bmap + nbmp;
+
+    img->bmp = check_malloc(nbmp * ssz);
+    memcpy(img->bmp, atr_data_range(atr, bmap, nbmp), nbmp * ssz);
+    secmap_init(&img->free, nsec);
+    secmap_load_sparta(&img->free, img->bmp);
+    secmap_init(&img->freed, nsec);
+    darray_init(img->dirs, 1);
+    return 0;
+}
+
+// Returns the sectors freed since the image was opened to the free pool
+static void simg_reuse_freed(struct simg *img)
+{
+    int sec = 0;
+    while( (sec = secmap_find(&img->freed, sec + 1)) > 0 )
+    {
+        secmap_set_free(&img->free, sec, 1);
+        secmap_set_used(&img->freed, sec, 1);
+    }
+}
+
+// Allocates up to "count" contiguous sectors, returns the first and the length.
+static unsigned simg_alloc(struct simg *img, unsigned count, unsigned *len)
+{
+    int sec = secmap_alloc_run(&img->free, img->next, count, len);
+    if( sec < 0 )
+        sec = secmap_alloc_run(&img->free, img->bmap + img->nbmp, count, len);
+    if( sec < 0 && secmap_count_free(&img->freed) )
     {
-        show_error("can't create backup '%s': %s", backup_file, strerror(errno));
-        fclose(src);
-        free(backup_file);
-        atr_free(atr);
-        return 1;
+        simg_reuse_freed(img);
+        sec = secmap_alloc_run(&img->free, img->bmap + img->nbmp, count, len);
     }
+    if( sec < 0 )
+        show_error("%s: disk full", img->name);
+    img->next = sec + *len;
+    return sec;
+}
+
+// Returns a sector for writing, cleared
+static uint8_t *simg_clear(struct simg *img, unsigned sec)
+{
+    uint8_t *buf = atr_data_rw(img->atr, sec);
+    memset(buf, 0, img->ssz);
+    return buf;
+}
+
+// Stores the data in new sectors, returns the first sector map
+static unsigned simg_add_data(struct simg *img, const uint8_t *data, size_t size)
+{
+    unsigned ssz = img->ssz, nd = (size + ssz - 1) / ssz;
+    unsigned nmap = nd ? (nd + img->slots - 1) / img->slots : 1;
+    if( secmap_count_free(&img->free) < nd + nmap )
+        simg_reuse_freed(img);
+    if( secmap_count_free(&img->free) < nd + nmap )
+        show_error("%s: not enough free space, %u sectors needed", img->name, nd + nmap);
 
-    // Copy file
-    uint8_t buffer[4096];
-    size_t n;
-    while( (n = fread(buffer, 1, sizeof(buffer), src)) > 0 )
+    unsigned first = 0, last = 0;
+    uint8_t *pmap  = 0;
+    do
     {
-        if( fwrite(buffer, 1, n, dst) != n )
+        unsigned len, smap = simg_alloc(img, 1, &len);
+        if( pmap )
+            put16(pmap, smap);
+        else
+            first = smap;
+        pmap = simg_clear(img, smap);
+        put16(pmap + 2, last);
+        // Copy data, allocating runs of contiguous sectors
+        unsigned i = 4;
+        while( i < ssz && size > 0 )
         {
-            show_error("error writing backup file");
-            fclose(src);
-            fclose(dst);
-            unlink(backup_file);
-            free(backup_file);
-            atr_free(atr);
-            return 1;
+            unsigned want = (size + ssz - 1) / ssz;
+            if( want > (ssz - i) / 2 )
+                want = (ssz - i) / 2;
+            unsigned sec = simg_alloc(img, want, &len);
+            for( unsigned j = 0; j < len; j++, i += 2 )
+            {
+                unsigned num = size < ssz ? size : ssz;
+                memcpy(simg_clear(img, sec + j), data, num);
+                data += num;
+                size -= num;
+                put16(pmap + i, sec + j);
+            }
         }
+        last = smap;
+    } while( size );
+    return first;
+}
+
+// Returns the directory at the given sector map, loading it if needed
+static struct sdir *sdir_get(struct simg *img, unsigned map, struct sdir *parent, unsigned pos)
+{
+    struct sdir **d;
+    darray_foreach(d, &img->dirs)
+    {
+        if( darray_i(&(*d)->maps, 0) == map )
+            return *d;
     }
-    fclose(src);
-    fclose(dst);
 
-    show_msg("Backup created: %s", backup_file);
-    show_msg("Note: Adding files requires rebuilding the image.");
-    show_msg("This feature is partially implemented - files will be added to a new image.");
+    struct atr_image *atr = img->atr;
+    struct sdir *dir      = check_calloc(1, sizeof(struct sdir));
+    dir->parent           = parent;
+    dir->pos              = pos;
+    darray_init(dir->maps, 1);
+    darray_init(dir->sect, 1);
 
-    // For now, we create a new image. Full implementation would:
-    // 1. Read all existing files from the ATR
-    // 2. Merge with new file list
-    // 3. Rebuild filesystem
-    // This is complex and would require significant additional code
-    
-    free(backup_file);
+    // Read the sector list, the size is in the first sector
+    unsigned nd = 1;
+    while( map && darray_len(&dir->sect) < nd )
+    {
+        const uint8_t *m = atr_data(atr, map);
+        if( !m || darray_len(&dir->maps) > atr->sec_count )
+            show_error("%s: invalid directory sector map", img->name);
+        darray_add(&dir->maps, map);
+        for( unsigned i = 4; i < img->ssz && darray_len(&dir->sect) < nd; i += 2 )
+        {
+            unsigned sec = read16(m + i);
+            if( !sec || !atr_data(atr, sec) )
+                show_error("%s: invalid directory sector map", img->name);
+            darray_add(&dir->sect, sec);
+            if( darray_len(&dir->sect) == 1 )
+            {
+                dir->size = read24(atr_data(atr, sec) + 3);
+                if( dir->size < 23 || dir->size > SFS_MAX_DIR_SIZE )
+                    show_error("%s: invalid directory size", img->name);
+                nd = (dir->size + img->ssz - 1) / img->ssz;
+            }
+        }
+        map = read16(m);
+    }
+    if( darray_len(&dir->sect) < nd )
+        show_error("%s: invalid directory sector map", img->name);
+
+    dir->data = check_malloc(nd * img->ssz);
+    for( unsigned i = 0; i < nd; i++ )
+        memcpy(dir->data + i * img->ssz, atr_data(atr, darray_i(&dir->sect, i)), img->ssz);
+    darray_add(&img->dirs, dir);
+    return dir;
+}
+
+static void sdir_free(struct sdir *dir)
+{
+    darray_delete(dir->maps);
+    darray_delete(dir->sect);
+    free(dir->data);
+    free(dir);
+}
+
+// Writes the changed bitmap sectors and the free count, and commits the image.
+static int simg_close(struct simg *img)
+{
+    struct atr_image *atr = img->atr;
+    unsigned ssz          = img->ssz;
+
+    simg_reuse_freed(img);
+    uint8_t *bmp = check_calloc(img->nbmp, ssz);
+    memcpy(bmp, img->bmp, img->nbmp * ssz);
+    secmap_store_sparta(&img->free, bmp);
+    for( unsigned i = 0; i < img->nbmp; i++ )
+    {
+        if( memcmp(bmp + i * ssz, img->bmp + i * ssz, ssz) )
+            memcpy(atr_data_rw(atr, img->bmap + i), bmp + i * ssz, ssz);
+    }
+    free(bmp);
+
+    // Update free count and the sequence number, so that DOS sees the change
+    uint8_t *sb = atr_data_rw(atr, 1);
+    put16(sb + 13, secmap_count_free(&img->free));
+    put16(sb + 18, img->next);
+    sb[38]++;
+
+    // Write the directories after the data, and the bitmap and boot sector last
+    struct sdir **d;
+    darray_foreach(d, &img->dirs)
+    {
+        unsigned *sec;
+        darray_foreach(sec, &(*d)->sect)
+        {
+            atr_commit_pass(atr, *sec, 1);
+        }
+        sdir_free(*d);
+    }
+    darray_delete(img->dirs);
+    for( unsigned i = 0; i < img->nbmp; i++ )
+        atr_commit_pass(atr, img->bmap + i, 2);
+    atr_commit_pass(atr, 1, 2);
+
+    int ret = atr_commit(atr);
+    if( ret )
+        show_msg("%s: error writing image", img->name);
+    secmap_delete(&img->free);
+    secmap_delete(&img->freed);
+    free(img->bmp);
     atr_free(atr);
+    return ret ? 1 : 0;
+}
+
+// Writes "len" bytes of directory data at "pos" to the image
+static void sdir_write(struct simg *img, struct sdir *dir, unsigned pos, unsigned len)
+{
+    while( len )
+    {
+        unsigned idx = pos / img->ssz, off = pos % img->ssz;
+        unsigned num = img->ssz - off < len ? img->ssz - off : len;
+        uint8_t *buf = atr_data_rw(img->atr, darray_i(&dir->sect, idx));
+        memcpy(buf + off, dir->data + pos, num);
+        pos += num;
+        len -= num;
+    }
+}
+
+// Returns the position of the entry with the given name, or 0 if not found
+static unsigned sdir_find(const struct sdir *dir, const char *aname)
+{
+    for( unsigned pos = 23; pos + 23 <= dir->size; pos += 23 )
+    {
+        const uint8_t *ent = dir->data + pos;
+        if( !ent[0] )
+            break;
+        if( (ent[0] & 0x18) == 0x08 && !memcmp(ent + 6, aname, 11) )
+            return pos;
+    }
     return 0;
 }
 
+// Adds a data sector at the end of the directory
+static void sdir_grow(struct simg *img, struct sdir *dir)
+{
+    unsigned len, nd = darray_len(&dir->sect);
+    if( nd == darray_len(&dir->maps) * img->slots )
+    {
+        // Link a new sector map
+        unsigned last = darray_i(&dir->maps, darray_len(&dir->maps) - 1);
+        unsigned smap = simg_alloc(img, 1, &len);
+        put16(simg_clear(img, smap) + 2, last);
+        put16(atr_data_rw(img->atr, last), smap);
+        darray_add(&dir->maps, smap);
+    }
+    unsigned sec  = simg_alloc(img, 1, &len);
+    unsigned map  = darray_i(&dir->maps, nd / img->slots);
+    put16(atr_data_rw(img->atr, map) + 4 + 2 * (nd % img->slots), sec);
+    simg_clear(img, sec);
+    darray_add(&dir->sect, sec);
+    dir->data = check_realloc(dir->data, (nd + 1) * img->ssz);
+    memset(dir->data + nd * img->ssz, 0, img->ssz);
+}
+
+// Sets the size in the directory header and in the parent entry
+static void sdir_resize(struct simg *img, struct sdir *dir, unsigned size)
+{
+    dir->size = size;
+    put24(dir->data + 3, size);
+    sdir_write(img, dir, 3, 3);
+    if( dir->parent )
+    {
+        put24(dir->parent->data + dir->pos + 3, size);
+        sdir_write(img, dir->parent, dir->pos + 3, 3);
+    }
+}
+
+// Stores the entry in the first free position of the directory, growing it if
+// needed. Returns the position.
+static unsigned sdir_add(struct simg *img, struct sdir *dir, const uint8_t *ent)
+{
+    unsigned pos;
+    for( pos = 23; pos + 23 <= dir->size; pos += 23 )
+    {
+        unsigned flags = dir->data[pos];
+        if( !flags || (flags & 0x18) != 0x08 )
+            break;
+    }
+    if( pos + 23 > dir->size )
+    {
+        if( dir->size + 23 > SFS_MAX_DIR_SIZE )
+            show_error("%s: too many files in directory", img->name);
+        while( dir->size + 23 > darray_len(&dir->sect) * img->ssz )
+            sdir_grow(img, dir);
+        sdir_resize(img, dir, dir->size + 23);
+    }
+    memcpy(dir->data + pos, ent, 23);
+    sdir_write(img, dir, pos, 23);
+    return pos;
+}
+
+// Converts the first component of the path to a padded 8+3 name, returns the
+// rest of the path or null if the name is not valid. An empty path gives an
+// empty name.
+static const char *path_part(const char *path, char *name)
+{
+    while( *path == '/' || *path == '\\' || *path == '>' )
+        path++;
+    memset(name, ' ', 11);
+    if( !*path )
+    {
+        name[0] = 0;
+        return path;
+    }
+    int pos = 0, dot = 0;
+    for( ; *path && *path != '/' && *path != '\\' && *path != '>'; path++ )
+    {
+        char c = *path;
+        if( c >= 'a' && c <= 'z' )
+            c = c - 'a' + 'A';
+        if( c == '.' && !dot )
+        {
+            pos = 8;
+            dot = 1;
+            continue;
+        }
+        if( (pos > 7 && !dot) || pos > 10 ||
+            !((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_') )
+            return 0;
+        name[pos++] = c;
+    }
+    while( *path == '/' || *path == '\\' || *path == '>' )
+        path++;
+    return name[0] != ' ' ? path : 0;
+}
+
+// Searches the path, storing the directory holding the last component in
+// "dir" and its name in "name". Returns the position of the entry, or 0 if
+// not found. If a directory in the path does not exist "dir" is null, and for
+// an empty path it is the main directory with an empty name.
+static unsigned simg_lookup(struct simg *img, const char *path, struct sdir **dir, char *name)
+{
+    struct sdir *d = sdir_get(img, img->root, 0, 0);
+    for( ;; )
+    {
+        path = path_part(path, name);
+        if( !path )
+            show_error("%s: invalid file name in path", img->name);
+        *dir = d;
+        if( !name[0] )
+            return 0;
+        unsigned pos = sdir_find(d, name);
+        if( !*path )
+            return pos;
+        if( !pos || !(d->data[pos] & 0x20) )
+        {
+            *dir = 0;
+            return 0;
+        }
+        d = sdir_get(img, read16(d->data + pos + 1), d, pos);
+    }
+}
+
+// Marks the entry as erased, dropping erased entries from the end
+static void sdir_erase(struct simg *img, struct sdir *dir, unsigned pos)
+{
+    dir->data[pos] = (dir->data[pos] & ~0x08) | 0x10;
+    sdir_write(img, dir, pos, 1);
+    unsigned size = dir->size;
+    while( size > 23 && (dir->data[size - 23] & 0x18) != 0x08 )
+        size -= 23;
+    if( size != dir->size )
+        sdir_resize(img, dir, size);
+}
+
+// Returns the sector maps and data sectors of a file to the free pool
+static void simg_free_file(struct simg *img, unsigned map)
+{
+    struct atr_image *atr = img->atr;
+    for( unsigned n = 0; map && n < atr->sec_count; n++ )
+    {
+        const uint8_t *m = atr_data(atr, map);
+        if( !m || map < img->bmap + img->nbmp )
+            show_error("%s: invalid sector map", img->name);
+        for( unsigned i = 4; i < img->ssz; i += 2 )
+        {
+            unsigned sec = read16(m + i);
+            if( sec >= img->bmap + img->nbmp && sec <= atr->sec_count )
+                secmap_set_free(&img->freed, sec, 1);
+        }
+        secmap_set_free(&img->freed, map, 1);
+        map = read16(m);
+    }
+}
+
+// Replace existing files when adding
+static int replace = 0;
+
+void modatr_set_replace(int enable)
+{
+    replace = enable;
+}
+
+// Add files to an existing ATR image
+int modatr_add_files(const char *atr_file, file_list *flist)
+{
+    struct simg img;
+    if( simg_open(&img, atr_file) )
+        return 1;
+
+    struct sdir *root = sdir_get(&img, img.root, 0, 0);
+
+    // Files are after their directories in the list
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        struct sdir *dir = root, **d;
+        darray_foreach(d, &img.dirs)
+        {
+            if( af->dir && (*d)->af == af->dir )
+                dir = *d;
+        }
+
+        uint8_t ent[23];
+        int boot     = af->boot_file;
+        unsigned pos = sdir_find(dir, af->aname);
+        if( pos && af->is_dir && (dir->data[pos] & 0x20) )
+        {
+            // Add to the existing directory
+            struct sdir *sub = sdir_get(&img, read16(dir->data + pos + 1), dir, pos);
+            sub->af          = af;
+            continue;
+        }
+        else if( pos && replace && !af->is_dir && !(dir->data[pos] & 0x20) )
+        {
+            // Replace the file, freeing the old sectors first
+            unsigned old = read16(dir->data + pos + 1);
+            if( dir->data[pos] & 0x01 )
+                show_error("%s: file '%s' is protected", atr_file, af->pname);
+            boot = boot || read16(atr_data(img.atr, 1) + 40) == old;
+            simg_free_file(&img, old);
+            sdir_erase(&img, dir, pos);
+        }
+        else if( pos )
+            show_error("%s: file '%s' already exists in image", atr_file, af->pname);
+
+        unsigned map;
+        if( af->is_dir )
+        {
+            // Create an empty directory
+            uint8_t hdr[23] = { 0x28 };
+            put16(hdr + 1, darray_i(&dir->maps, 0));
+            put24(hdr + 3, 23);
+            memcpy(hdr + 6, af->aname, 11);
+            memcpy(hdr + 17, af->date, 3);
+            memcpy(hdr + 20, af->time, 3);
+            map = simg_add_data(&img, hdr, 23);
+        }
+        else
+            map = simg_add_data(&img, (const uint8_t *)af->data, af->size);
+
+        ent[0] = 0x08 | (af->is_dir ? 0x20 : 0x00) | af->attribs;
+        put16(ent + 1, map);
+        put24(ent + 3, af->is_dir ? 23 : af->size);
+        memcpy(ent + 6, af->aname, 11);
+        memcpy(ent + 17, af->date, 3);
+        memcpy(ent + 20, af->time, 3);
+        pos = sdir_add(&img, dir, ent);
+
+        if( af->is_dir )
+        {
+            struct sdir *sub = sdir_get(&img, map, dir, pos);
+            sub->af          = af;
+        }
+        if( boot )
+            put16(atr_data_rw(img.atr, 1) + 40, map);
+    }
+
+    unsigned nfree = secmap_count_free(&img.free) + secmap_count_free(&img.freed);
+    int ret        = simg_close(&img);
+    if( !ret )
+        show_msg("%s: added %d files, %u sectors free.", atr_file, (int)darray_len(flist), nfree);
+    return ret;
+}
+
 // Delete a file from an existing ATR image
 int modatr_delete_file(const char *atr_file, const char *file_path)
 {
-    show_error("File deletion not yet implemented");
-    return 1;
+    struct simg img;
+    if( simg_open(&img, atr_file) )
+        return 1;
+
+    struct sdir *dir;
+    char name[11];
+    unsigned pos = simg_lookup(&img, file_path, &dir, name);
+    if( !pos )
+        show_error("%s: file '%s' not found in image", atr_file, file_path);
+
+    unsigned map = read16(dir->data + pos + 1);
+    if( dir->data[pos] & 0x20 )
+    {
+        // Only empty directories can be deleted
+        struct sdir *sub = sdir_get(&img, map, dir, pos);
+        for( unsigned p = 23; p + 23 <= sub->size && sub->data[p]; p += 23 )
+        {
+            if( (sub->data[p] & 0x18) == 0x08 )
+                show_error("%s: directory '%s' is not empty", atr_file, file_path);
+        }
+    }
+    else if( dir->data[pos] & 0x01 )
+        show_error("%s: file '%s' is protected", atr_file, file_path);
+
+    simg_free_file(&img, map);
+    sdir_erase(&img, dir, pos);
+
+    // Remove the boot file
+    const uint8_t *sb = atr_data(img.atr, 1);
+    if( read16(sb + 40) == map )
+        put16(atr_data_rw(img.atr, 1) + 40, 0);
+
+    return simg_close(&img);
 }
 
 // Rename a file in an existing ATR image
 int modatr_rename_file(const char *atr_file, const char *old_path, const char *new_path)
 {
-    show_error("File renaming not yet implemented");
-    return 1;
+    struct simg img;
+    if( simg_open(&img, atr_file) )
+        return 1;
+
+    struct sdir *odir, *ndir;
+    char oname[11], nname[11];
+    unsigned opos = simg_lookup(&img, old_path, &odir, oname);
+    if( !opos )
+        show_error("%s: file '%s' not found in image", atr_file, old_path);
+    unsigned npos = simg_lookup(&img, new_path, &ndir, nname);
+    if( !ndir )
+        show_error("%s: directory of '%s' not found in image", atr_file, new_path);
+    if( !nname[0] || (npos && (ndir->data[npos] & 0x20)) )
+    {
+        // Move into the directory, keeping the name
+        if( nname[0] )
+            ndir = sdir_get(&img, read16(ndir->data + npos + 1), ndir, npos);
+        memcpy(nname, oname, 11);
+        npos = sdir_find(ndir, nname);
+    }
+    if( npos && (ndir != odir || npos != opos) )
+        show_error("%s: file '%s' already exists in image", atr_file, new_path);
+
+    uint8_t ent[23];
+    unsigned map = read16(odir->data + opos + 1);
+    memcpy(ent, odir->data + opos, 23);
+    memcpy(ent + 6, nname, 11);
+    struct sdir *sub = 0;
+    if( ent[0] & 0x20 )
+    {
+        // Can't move a directory inside itself
+        sub = sdir_get(&img, map, odir, opos);
+        for( struct sdir *d = ndir; d; d = d->parent )
+        {
+            if( d == sub )
+                show_error("%s: can't move '%s' inside itself", atr_file, old_path);
+        }
+    }
+
+    if( ndir == odir )
+    {
+        memcpy(odir->data + opos + 6, nname, 11);
+        sdir_write(&img, odir, opos + 6, 11);
+    }
+    else
+    {
+        npos = sdir_add(&img, ndir, ent);
+        sdir_erase(&img, odir, opos);
+    }
+
+    // The directory header holds the name and the parent
+    if( sub )
+    {
+        sub->parent = ndir;
+        sub->pos    = ndir == odir ? opos : npos;
+        put16(sub->data + 1, darray_i(&ndir->maps, 0));
+        memcpy(sub->data + 6, nname, 11);
+        sdir_write(&img, sub, 1, 16);
+    }
+
+    return simg_close(&img);
 }
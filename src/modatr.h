@@ -25,6 +25,9 @@
 // Returns 0 on success, 1 on error
 int modatr_add_files(const char *atr_file, file_list *flist);
 
+// Replace files that already exist when adding, instead of failing
+void modatr_set_replace(int enable);
+
 // Delete a file from an existing ATR image
 // Returns 0 on success, 1 on error
 int modatr_delete_file(const char *atr_file, const char *file_path);
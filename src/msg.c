@@ -26,14 +26,39 @@
 const char *prog_name;
 int quiet_mode = 0;
 
+// Per thread output
+static _Thread_local FILE *thr_out;
+static _Thread_local FILE *thr_err;
+static _Thread_local jmp_buf *thr_trap;
+
+FILE *msg_out(void)
+{
+    return thr_out ? thr_out : stdout;
+}
+
+FILE *msg_err(void)
+{
+    return thr_err ? thr_err : stderr;
+}
+
+void msg_redirect(FILE *out, FILE *err, jmp_buf *trap)
+{
+    thr_out  = out;
+    thr_err  = err;
+    thr_trap = trap;
+}
+
 void show_error(const char *format, ...)
 {
     va_list ap;
-    fprintf(stderr, "%s: Error, ", prog_name);
+    FILE *err = msg_err();
+    fprintf(err, "%s: Error, ", prog_name);
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
+    vfprintf(err, format, ap);
     va_end(ap);
-    fprintf(stderr, "\n");
+    fprintf(err, "\n");
+    if( thr_trap )
+        longjmp(*thr_trap, 1);
     exit(EXIT_FAILURE);
 }
 
@@ -42,11 +67,12 @@ void show_msg(const char *format, ...)
     if( quiet_mode )
         return;
     va_list ap;
-    fprintf(stderr, "%s: ", prog_name);
+    FILE *err = msg_err();
+    fprintf(err, "%s: ", prog_name);
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
+    vfprintf(err, format, ap);
     va_end(ap);
-    fprintf(stderr, "\n");
+    fprintf(err, "\n");
 }
 
 void show_opt_error(const char *format, ...)
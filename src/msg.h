@@ -18,7 +18,9 @@
  * Shows error messages.
  */
 #pragma once
+#include <setjmp.h>
 #include <stddef.h>
+#include <stdio.h>
 
 extern const char *prog_name;
 extern int quiet_mode;
@@ -28,6 +30,12 @@ void show_opt_error(const char *format, ...)
     __attribute__((noreturn, format(printf, 1, 2)));
 void show_msg(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void show_version(void);
+// Output streams of the calling thread, stdout and stderr by default.
+FILE *msg_out(void);
+FILE *msg_err(void);
+// Redirects the output of the calling thread to "out" and "err", and makes
+// show_error() jump to "trap" instead of exiting if not null.
+void msg_redirect(FILE *out, FILE *err, jmp_buf *trap);
 void memory_error(void) __attribute__((noreturn));
 void *check_malloc(size_t size);
 void *check_calloc(size_t nmemb, size_t size);
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Identify ATR images without loading them.
+ */
+#include "probe.h"
+#include "atr.h"
+#include "lsdos.h"
+#include "lsextra.h"
+#include "lshowfen.h"
+#include "lssfs.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int atr_probe(const char *file_name, struct atr_probe *res)
+{
+    memset(res, 0, sizeof(*res));
+
+    int fd = open(file_name, O_RDONLY);
+    if( fd < 0 )
+        return -1;
+
+    // Same geometry as atr_open()
+    struct stat st;
+    uint8_t hdr[16];
+    struct atr_geometry geo;
+    if( fstat(fd, &st) || !S_ISREG(st.st_mode) || read(fd, hdr, 16) != 16 ||
+        atr_parse_header(hdr, st.st_size, &geo) != atr_header_ok || !geo.sec_count )
+    {
+        close(fd);
+        return -1;
+    }
+    res->sec_size  = geo.sec_size;
+    res->sec_count = geo.sec_count;
+
+    // Read sectors on demand, so only the ones tested by the probes are read
+    struct atr_image *atr = atr_lazy_fd(fd, &geo);
+    if( !atr )
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Same order as used by lsatr, first match wins
+    static int (*const probes[])(struct atr_image *, const char **) = {
+        sfs_probe, howfen_probe, dos_probe, extra_probe};
+    for( unsigned i = 0; i < sizeof(probes) / sizeof(probes[0]); i++ )
+    {
+        const char *name = 0;
+        int c            = probes[i](atr, &name);
+        if( c > 0 )
+        {
+            res->fs         = name;
+            res->confidence = c;
+            break;
+        }
+    }
+    atr_free(atr);
+    return 0;
+}
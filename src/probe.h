@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Identify ATR images without loading them.
+ */
+#pragma once
+
+struct atr_probe
+{
+    const char *fs;     // File system or boot format, 0 if not recognized
+    unsigned sec_size;  // Sector size, 128 or 256
+    unsigned sec_count; // Number of sectors
+    int confidence;     // 0 to 100, 0 if the format is not recognized
+};
+
+// Identifies the image reading only the header and sectors 1 to 3, 360 and
+// 361, or the full image if it needs fixing like atr_open() does. Prints
+// nothing. Returns 0 on success or -1 if the file is not a valid
+// ATR image.
+int atr_probe(const char *file_name, struct atr_probe *res);
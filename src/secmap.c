@@ -0,0 +1,176 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Free sector bitmap.
+ */
+#include "secmap.h"
+#include "msg.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Number of 64 bit words in the map
+static unsigned map_words(const struct secmap *m)
+{
+    return (m->nsec >> 6) + 1;
+}
+
+void secmap_init(struct secmap *m, unsigned nsec)
+{
+    m->nsec = nsec;
+    m->bits = check_calloc(map_words(m), sizeof(uint64_t));
+}
+
+void secmap_delete(struct secmap *m)
+{
+    free(m->bits);
+    m->bits = 0;
+}
+
+// Sets or clears bits from "first" to "first + count - 1"
+static void set_range(struct secmap *m, unsigned first, unsigned count, int value)
+{
+    if( first < 1 )
+    {
+        if( count <= 1 - first )
+            return;
+        count -= 1 - first;
+        first = 1;
+    }
+    if( first > m->nsec )
+        return;
+    if( count > m->nsec - first + 1 )
+        count = m->nsec - first + 1;
+    if( !count )
+        return;
+
+    unsigned last  = first + count - 1;
+    unsigned w1    = first >> 6, w2 = last >> 6;
+    uint64_t mask1 = ~(uint64_t)0 << (first & 63);
+    uint64_t mask2 = ~(uint64_t)0 >> (63 - (last & 63));
+    if( w1 == w2 )
+        mask1 &= mask2;
+    if( value )
+        m->bits[w1] |= mask1;
+    else
+        m->bits[w1] &= ~mask1;
+    if( w1 == w2 )
+        return;
+    // Whole words in the middle
+    memset(m->bits + w1 + 1, value ? 0xFF : 0, (w2 - w1 - 1) * sizeof(uint64_t));
+    if( value )
+        m->bits[w2] |= mask2;
+    else
+        m->bits[w2] &= ~mask2;
+}
+
+void secmap_set_free(struct secmap *m, unsigned first, unsigned count)
+{
+    set_range(m, first, count, 1);
+}
+
+void secmap_set_used(struct secmap *m, unsigned first, unsigned count)
+{
+    set_range(m, first, count, 0);
+}
+
+int secmap_is_free(const struct secmap *m, unsigned sec)
+{
+    if( sec > m->nsec )
+        return 0;
+    return (m->bits[sec >> 6] >> (sec & 63)) & 1;
+}
+
+// Returns the first bit equal to "value" not less than "start", or -1.
+static int find_bit(const struct secmap *m, unsigned start, int value)
+{
+    if( start > m->nsec )
+        return -1;
+    uint64_t inv = value ? 0 : ~(uint64_t)0;
+    unsigned w   = start >> 6, nw = map_words(m);
+    uint64_t x   = (m->bits[w] ^ inv) & (~(uint64_t)0 << (start & 63));
+    while( !x )
+    {
+        if( ++w >= nw )
+            return -1;
+        x = m->bits[w] ^ inv;
+    }
+    unsigned bit = (w << 6) + __builtin_ctzll(x);
+    return bit <= m->nsec ? (int)bit : -1;
+}
+
+int secmap_find(const struct secmap *m, unsigned start)
+{
+    return find_bit(m, start, 1);
+}
+
+int secmap_alloc(struct secmap *m, unsigned start)
+{
+    int sec = find_bit(m, start, 1);
+    if( sec > 0 )
+        m->bits[sec >> 6] &= ~((uint64_t)1 << (sec & 63));
+    return sec;
+}
+
+int secmap_alloc_run(struct secmap *m, unsigned start, unsigned count, unsigned *len)
+{
+    int sec = find_bit(m, start, 1);
+    if( sec < 0 || !count )
+        return -1;
+    // The run ends at the next used sector or at the end of the map
+    int end    = find_bit(m, sec, 0);
+    unsigned n = (end < 0 ? m->nsec + 1 : (unsigned)end) - sec;
+    if( n > count )
+        n = count;
+    set_range(m, sec, n, 0);
+    *len = n;
+    return sec;
+}
+
+unsigned secmap_count_free(const struct secmap *m)
+{
+    unsigned n = 0;
+    for( unsigned i = 0; i < map_words(m); i++ )
+        n += __builtin_popcountll(m->bits[i]);
+    return n;
+}
+
+// Reverses the bits in a byte
+static uint8_t rev8(uint8_t x)
+{
+    x = (x >> 4) | (x << 4);
+    x = ((x >> 2) & 0x33) | ((x & 0x33) << 2);
+    return ((x >> 1) & 0x55) | ((x & 0x55) << 1);
+}
+
+void secmap_load_sparta(struct secmap *m, const uint8_t *bmp)
+{
+    unsigned nbytes = (m->nsec >> 3) + 1;
+    memset(m->bits, 0, map_words(m) * sizeof(uint64_t));
+    for( unsigned i = 0; i < nbytes; i++ )
+        m->bits[i >> 3] |= (uint64_t)rev8(bmp[i]) << ((i & 7) * 8);
+    // Sector 0 and sectors past the end are never free
+    m->bits[0] &= ~(uint64_t)1;
+    if( (m->nsec & 63) != 63 )
+        m->bits[m->nsec >> 6] &= ~(~(uint64_t)0 << ((m->nsec & 63) + 1));
+}
+
+void secmap_store_sparta(const struct secmap *m, uint8_t *bmp)
+{
+    unsigned nbytes = (m->nsec >> 3) + 1;
+    for( unsigned i = 0; i < nbytes; i++ )
+        bmp[i] = rev8(m->bits[i >> 3] >> ((i & 7) * 8));
+}
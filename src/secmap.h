@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Free sector bitmap.
+ */
+#pragma once
+#include <stdint.h>
+
+// Free sector map, bit "n" is set if sector "n" is free. Sector 0 is always used.
+struct secmap
+{
+    uint64_t *bits;
+    unsigned nsec;
+};
+
+// Initialize the map for sectors 1 to "nsec", all used.
+void secmap_init(struct secmap *m, unsigned nsec);
+// Deallocates memory for the map.
+void secmap_delete(struct secmap *m);
+// Marks "count" sectors starting at "first" as free or used.
+void secmap_set_free(struct secmap *m, unsigned first, unsigned count);
+void secmap_set_used(struct secmap *m, unsigned first, unsigned count);
+// Returns true if the sector is free.
+int secmap_is_free(const struct secmap *m, unsigned sec);
+// Returns the first free sector not less than "start", or -1 if none.
+int secmap_find(const struct secmap *m, unsigned start);
+// Allocates the first free sector not less than "start", or returns -1.
+int secmap_alloc(struct secmap *m, unsigned start);
+// Allocates the first run of contiguous free sectors not less than "start", up to
+// "count" sectors long. Returns the first sector and stores the length in "len",
+// or returns -1 if there are no free sectors.
+int secmap_alloc_run(struct secmap *m, unsigned start, unsigned count, unsigned *len);
+// Returns the number of free sectors.
+unsigned secmap_count_free(const struct secmap *m);
+// Loads or stores the map in SpartaDOS format, with sector "n" at bit 7-(n&7)
+// of byte n>>3, covering bytes 0 to nsec>>3.
+void secmap_load_sparta(struct secmap *m, const uint8_t *bmp);
+void secmap_store_sparta(const struct secmap *m, uint8_t *bmp);
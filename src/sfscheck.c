@@ -0,0 +1,233 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Checks the consistency of a SpartaDOS file system, used by "make check":
+ * the size of each directory against its entry, the parent links, sectors
+ * used twice, and the bitmap and free count against the reachable sectors.
+ * Does not share code with the readers, to also catch bugs in those.
+ */
+#include "atr.h"
+#include "msg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct check
+{
+    struct atr_image *atr;
+    unsigned nsec;    // Sectors in the file system
+    uint8_t *used;    // Use of each sector
+    unsigned errors;  // Errors found
+    unsigned files;   // Files found
+    unsigned dirs;    // Directories found
+};
+
+static void check_error(struct check *ck, const char *path, const char *msg, unsigned a,
+                        unsigned b)
+{
+    ck->errors++;
+    show_msg("%s: %s (%u, %u)", path[0] ? path : "/", msg, a, b);
+}
+
+static unsigned read16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned read24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+// Marks a sector as used, returns 0 if it was free and valid
+static int use_sector(struct check *ck, const char *path, unsigned n)
+{
+    if( n < 1 || n > ck->nsec )
+    {
+        check_error(ck, path, "invalid sector", n, ck->nsec);
+        return 1;
+    }
+    if( ck->used[n] )
+    {
+        check_error(ck, path, "sector used twice", n, ck->used[n]);
+        return 1;
+    }
+    ck->used[n] = 1;
+    return 0;
+}
+
+// Marks all the sectors of a file as used, and copies the data to "data" if
+// not null. Returns 0 if all the sectors are valid.
+static int use_file(struct check *ck, const char *path, unsigned map, unsigned size,
+                    uint8_t *data)
+{
+    unsigned ss = ck->atr->sec_size;
+    unsigned left = (size + ss - 1) / ss;
+    unsigned pos = 0;
+    int ret = 0;
+    if( data )
+        memset(data, 0, size);
+    while( map )
+    {
+        if( use_sector(ck, path, map) )
+            return 1;
+        const uint8_t *m = atr_data(ck->atr, map);
+        for( unsigned i = 4; i < ss && left; i += 2, left--, pos += ss )
+        {
+            unsigned s = read16(m + i);
+            if( !s )
+                continue; // Hole in sparse file
+            if( use_sector(ck, path, s) )
+                ret = 1;
+            else if( data )
+                memcpy(data + pos, atr_data(ck->atr, s), size - pos < ss ? size - pos : ss);
+        }
+        map = read16(m);
+    }
+    if( left )
+    {
+        check_error(ck, path, "sectors missing from map", left, size);
+        ret = 1;
+    }
+    return ret;
+}
+
+// Checks a directory and all the files in it. "size" is the size in the parent
+// entry, or 0 for the root.
+static void check_dir(struct check *ck, const char *path, unsigned map, unsigned size,
+                      unsigned parent)
+{
+    ck->dirs++;
+    // Get the size from the header in the first data sector
+    if( map < 1 || map > ck->nsec )
+    {
+        check_error(ck, path, "invalid directory map", map, ck->nsec);
+        return;
+    }
+    unsigned first = read16(atr_data(ck->atr, map) + 4);
+    if( first < 1 || first > ck->nsec )
+    {
+        check_error(ck, path, "invalid directory sector", first, ck->nsec);
+        return;
+    }
+    const uint8_t *hdr = atr_data(ck->atr, first);
+    unsigned dsize = read24(hdr + 3);
+    if( size && size != dsize )
+        check_error(ck, path, "directory size does not match entry", dsize, size);
+    if( read16(hdr + 1) != parent )
+        check_error(ck, path, "wrong parent directory", read16(hdr + 1), parent);
+    if( dsize < 23 || dsize / ck->atr->sec_size > ck->nsec )
+    {
+        check_error(ck, path, "invalid directory size", dsize, 23);
+        return;
+    }
+
+    uint8_t *data = check_malloc(dsize);
+    if( !use_file(ck, path, map, dsize, data) )
+    {
+        for( unsigned ofs = 23; ofs + 23 <= dsize; ofs += 23 )
+        {
+            const uint8_t *e = data + ofs;
+            if( !e[0] )
+                break;
+            if( !(e[0] & 0x08) || (e[0] & 0x10) )
+                continue;
+            // Full path, as "DIR/NAME.EXT"
+            size_t len = strlen(path);
+            char *name = check_malloc(len + 14), *p = name + len;
+            memcpy(name, path, len);
+            *p++ = '/';
+            for( int i = 0; i < 11; i++ )
+            {
+                if( i == 8 && e[6 + i] != ' ' )
+                    *p++ = '.';
+                if( e[6 + i] != ' ' )
+                    *p++ = e[6 + i];
+            }
+            *p = 0;
+            if( e[0] & 0x20 )
+                check_dir(ck, name, read16(e + 1), read24(e + 3), map);
+            else
+            {
+                ck->files++;
+                use_file(ck, name, read16(e + 1), read24(e + 3), 0);
+            }
+            free(name);
+        }
+    }
+    free(data);
+}
+
+static void check_image(struct check *ck)
+{
+    struct atr_image *atr = ck->atr;
+    unsigned ss = atr->sec_size;
+    const uint8_t *sb = atr_data(atr, 1);
+    if( sb[7] != 0x80 )
+        show_error("not a SpartaDOS image");
+    ck->nsec = read16(sb + 11);
+    if( ck->nsec > atr->sec_count )
+        show_error("file system of %u sectors in image of %u", ck->nsec, atr->sec_count);
+    ck->used = check_calloc(ck->nsec + 1, 1);
+
+    // Boot sectors and bitmap, up to the last bitmap sector
+    unsigned bm = read16(sb + 16), nb = sb[15];
+    if( !nb || bm < 2 || bm + nb - 1 > ck->nsec || nb * ss * 8 <= ck->nsec )
+        show_error("invalid bitmap at sector %u, %u sectors", bm, nb);
+    for( unsigned n = 1; n < bm + nb; n++ )
+        use_sector(ck, "bitmap", n);
+
+    check_dir(ck, "", read16(sb + 9), 0, 0);
+
+    // Compare with the bitmap, a set bit is a free sector
+    unsigned nfree = 0;
+    for( unsigned n = 1; n <= ck->nsec; n++ )
+    {
+        const uint8_t *b = atr_data(atr, bm + (n >> 3) / ss);
+        int is_free = (b[(n >> 3) % ss] >> (7 - (n & 7))) & 1;
+        nfree += is_free;
+        if( is_free == ck->used[n] )
+            check_error(ck, "bitmap", is_free ? "used sector marked free" : "lost sector", n,
+                        ck->used[n]);
+    }
+    if( nfree != read16(sb + 13) )
+        check_error(ck, "bitmap", "wrong free sector count", read16(sb + 13), nfree);
+    free(ck->used);
+}
+
+int main(int argc, char **argv)
+{
+    prog_name = argv[0];
+    if( argc != 2 )
+    {
+        fprintf(stderr, "Usage: %s image.atr\n", prog_name);
+        return EXIT_FAILURE;
+    }
+    struct check ck = { 0 };
+    ck.atr = atr_open(argv[1], atr_load_copy);
+    if( !ck.atr )
+        show_error("can't open '%s'", argv[1]);
+    check_image(&ck);
+    atr_free(ck.atr);
+    if( ck.errors )
+    {
+        fprintf(stderr, "%s: %u errors\n", argv[1], ck.errors);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %u files, %u directories, ok\n", argv[1], ck.files, ck.dirs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,473 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Index of all the directories of a SpartaDOS file system.
+ */
+#include "sfsdir.h"
+#include "arena.h"
+#include "msg.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if !( defined(_WIN32) || defined(__WIN32__) )
+#define SFS_WRITEV 1
+#include <sys/uio.h>
+#endif
+
+// Max directory size (2848 entries)
+#define MAX_DIR_SIZE 65536
+
+// Buffers written at once by sfs_write_file()
+#define MAX_IOV 64
+
+// Data of the holes in sparse files
+static const uint8_t zeros[4096];
+
+struct sfs_index
+{
+    struct atr_image *atr;
+    struct sfs_entry *root;
+    // Hash table of entries by path, with open addressing
+    struct sfs_entry **slot;
+    uint32_t *hash;
+    unsigned mask; // Table size - 1, the size is a power of two
+    unsigned count;
+    uint8_t *visited; // Directory maps already read, to stop on loops
+    uint8_t *buf;     // Data of the directory being read
+    struct arena mem; // Entries and paths
+};
+
+//---------------------------------------------------------------------
+static unsigned read16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned read24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static int fold(int c)
+{
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+// FNV-1a hash of the path, ignoring case
+static uint32_t path_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    while( len-- )
+        h = (h ^ (uint8_t)fold(*path++)) * 16777619u;
+    return h;
+}
+
+static void table_insert(struct sfs_index *idx, uint32_t h, struct sfs_entry *e)
+{
+    unsigned i = h & idx->mask;
+    while( idx->slot[i] )
+        i = (i + 1) & idx->mask;
+    idx->slot[i] = e;
+    idx->hash[i] = h;
+}
+
+// Adds an entry, growing the table to keep it at most half full
+static void table_add(struct sfs_index *idx, struct sfs_entry *e)
+{
+    if( 2 * (idx->count + 1) > idx->mask + 1 )
+    {
+        struct sfs_entry **old_slot = idx->slot;
+        uint32_t *old_hash          = idx->hash;
+        unsigned old_size           = old_slot ? idx->mask + 1 : 0;
+        unsigned size               = old_size ? 2 * old_size : 64;
+        idx->slot                   = check_calloc(size, sizeof(idx->slot[0]));
+        idx->hash                   = check_calloc(size, sizeof(idx->hash[0]));
+        idx->mask                   = size - 1;
+        for( unsigned i = 0; i < old_size; i++ )
+            if( old_slot[i] )
+                table_insert(idx, old_hash[i], old_slot[i]);
+        free(old_slot);
+        free(old_hash);
+    }
+    table_insert(idx, path_hash(e->path, strlen(e->path)), e);
+    idx->count++;
+}
+
+static void read_dir(struct sfs_index *idx, struct sfs_entry *dir)
+{
+    const char *dname = *dir->path ? dir->path : "/";
+    if( idx->visited[dir->map] )
+    {
+        show_msg("%s: directory loop, skip", dname);
+        return;
+    }
+    idx->visited[dir->map] = 1;
+
+    uint8_t *data = idx->buf;
+    unsigned len  = sfs_read_file(idx->atr, dir->map, MAX_DIR_SIZE, data);
+    if( len < 23 )
+    {
+        show_msg("%s: can't get directory data", dname);
+        return;
+    }
+    else if( len == MAX_DIR_SIZE )
+        show_msg("%s: directory too big", dname);
+    if( !dir->dir )
+    {
+        // The root has no entry in a parent, use the directory header
+        dir->size = read24(data + 3);
+        memcpy(dir->date, data + 17, 3);
+        memcpy(dir->time, data + 20, 3);
+    }
+
+    struct sfs_entry **last = &dir->child;
+    for( unsigned i = 23; i + 23 <= len; i += 23 )
+    {
+        unsigned flags = data[i];
+        if( !flags )
+            break; // no more entries
+        if( 0 == (flags & 0x08) )
+            continue; // unused
+        if( 0x10 == (flags & 0x10) )
+            continue; // erased
+        char fname[16], aname[16];
+        if( !sfs_get_name(fname, aname, data + i + 6, 11, 0) )
+        {
+            show_msg("%s: invalid file name, skip", dname);
+            continue;
+        }
+
+        size_t plen         = strlen(dir->path);
+        char *path          = arena_alloc(&idx->mem, plen + strlen(fname) + 2);
+        struct sfs_entry *e = arena_alloc(&idx->mem, sizeof(struct sfs_entry));
+        if( plen )
+        {
+            memcpy(path, dir->path, plen);
+            path[plen++] = '/';
+        }
+        strcpy(path + plen, fname);
+        e->path  = path;
+        e->name  = path + plen;
+        e->dir   = dir;
+        e->child = 0;
+        e->next  = 0;
+        e->flags = flags;
+        e->map   = read16(data + i + 1);
+        e->size  = read24(data + i + 3);
+        memcpy(e->aname, data + i + 6, 11);
+        memcpy(e->date, data + i + 17, 3);
+        memcpy(e->time, data + i + 20, 3);
+        *last = e;
+        last  = &e->next;
+        table_add(idx, e);
+    }
+
+    // Read the sub-directories after, reusing the buffer
+    for( struct sfs_entry *e = dir->child; e; e = e->next )
+    {
+        if( !(e->flags & 0x20) )
+            continue;
+        if( e->map < 2 || e->map > idx->atr->sec_count )
+            show_msg("%s: invalid sector map", e->path);
+        else
+            read_dir(idx, e);
+    }
+}
+
+//---------------------------------------------------------------------
+struct sfs_index *sfs_index_load(struct atr_image *atr)
+{
+    // Same checks as sfs_probe()
+    const uint8_t *boot = atr_data(atr, 1);
+    if( !boot || atr->sec_count < 6 || boot[7] != 0x80 ||
+        (boot[31] ? boot[31] : 256) != atr->sec_size )
+        return 0;
+    unsigned root_map = read16(boot + 9);
+    if( root_map < 2 || root_map > atr->sec_count )
+        return 0;
+
+    struct sfs_index *idx = check_calloc(1, sizeof(struct sfs_index));
+    idx->atr              = atr;
+    idx->visited          = check_calloc(atr->sec_count + 1, 1);
+    idx->buf              = check_malloc(MAX_DIR_SIZE);
+
+    struct sfs_entry *root = arena_alloc(&idx->mem, sizeof(struct sfs_entry));
+    memset(root, 0, sizeof(struct sfs_entry));
+    memset(root->aname, ' ', 11);
+    root->path  = "";
+    root->name  = "";
+    root->flags = 0x28;
+    root->map   = root_map;
+    idx->root   = root;
+    table_add(idx, root);
+    read_dir(idx, root);
+
+    free(idx->visited);
+    free(idx->buf);
+    idx->visited = 0;
+    idx->buf     = 0;
+    return idx;
+}
+
+const struct sfs_entry *sfs_index_root(const struct sfs_index *idx)
+{
+    return idx->root;
+}
+
+const struct sfs_entry *sfs_index_find(const struct sfs_index *idx, const char *path)
+{
+    // Remove the extra separators, so the path is like the ones in the index
+    char *key = check_malloc(strlen(path) + 1);
+    size_t len = 0;
+    for( ; *path; path++ )
+    {
+        if( *path != '/' )
+            key[len++] = *path;
+        else if( len && key[len - 1] != '/' )
+            key[len++] = '/';
+    }
+    if( len && key[len - 1] == '/' )
+        len--;
+    key[len] = 0;
+
+    uint32_t h = path_hash(key, len);
+    const struct sfs_entry *ret = 0;
+    for( unsigned i = h & idx->mask; idx->slot[i] && !ret; i = (i + 1) & idx->mask )
+    {
+        const char *p = idx->slot[i]->path;
+        if( idx->hash[i] != h )
+            continue;
+        size_t j = 0;
+        while( j < len && fold(p[j]) == fold(key[j]) )
+            j++;
+        if( j == len && !p[len] )
+            ret = idx->slot[i];
+    }
+    free(key);
+    return ret;
+}
+
+void sfs_index_free(struct sfs_index *idx)
+{
+    if( !idx )
+        return;
+    free(idx->slot);
+    free(idx->hash);
+    arena_free(&idx->mem);
+    free(idx);
+}
+
+//---------------------------------------------------------------------
+void sfs_extent_init(struct sfs_extent *ext, const struct atr_image *atr, unsigned map,
+                     unsigned size)
+{
+    ext->data  = 0;
+    ext->len   = 0;
+    ext->reads = 0;
+    ext->atr   = atr;
+    ext->map   = map;
+    ext->slot  = 4;
+    ext->left  = size;
+    ext->maps  = 0;
+}
+
+// Returns the data of the sector, counting the reads
+static const uint8_t *ext_data(struct sfs_extent *ext, unsigned sec)
+{
+    ext->reads++;
+    return atr_data(ext->atr, sec);
+}
+
+int sfs_extent_next(struct sfs_extent *ext)
+{
+    const struct atr_image *atr = ext->atr;
+    unsigned ssz                = atr->sec_size;
+    ext->len                    = 0;
+    if( !ext->left )
+        return 0;
+
+    const uint8_t *m = ext->map >= 2 ? ext_data(ext, ext->map) : 0;
+    if( !m )
+    {
+        show_msg("invalid sector map");
+        return ext->left = 0;
+    }
+    while( ext->left && ext->len < SFS_EXTENT_SECTORS * ssz )
+    {
+        if( ext->slot >= ssz )
+        {
+            // Go to the next map, ending the extent
+            unsigned next = read16(m);
+            if( ext->len )
+                break;
+            if( !next )
+                return ext->left = 0;
+            if( next < 2 || next > atr->sec_count || !(m = ext_data(ext, next)) )
+            {
+                show_msg("invalid next sector map");
+                return ext->left = 0;
+            }
+            if( ++ext->maps >= atr->sec_count )
+            {
+                show_msg("sector map chain too long, possible loop");
+                return ext->left = 0;
+            }
+            ext->map  = next;
+            ext->slot = 4;
+        }
+
+        unsigned sec = read16(m + ext->slot);
+        unsigned rem = ext->left > ssz ? ssz : ext->left;
+        const uint8_t *d;
+        if( !sec )
+        {
+            // Holes are joined only with holes, up to the size of the zeros
+            if( ext->len && (ext->data != zeros || ext->len + rem > sizeof(zeros)) )
+                break;
+            d = zeros + ext->len;
+        }
+        else if( sec < 2 || sec > atr->sec_count || !(d = ext_data(ext, sec)) )
+        {
+            if( ext->len )
+                break; // Return the data before, the error is shown next time
+            show_msg("invalid data sector %u", sec);
+            return ext->left = 0;
+        }
+        else if( ext->len && d != ext->data + ext->len )
+            break;
+
+        if( !ext->len )
+            ext->data = d;
+        ext->len += rem;
+        ext->left -= rem;
+        ext->slot += 2;
+    }
+    return 1;
+}
+
+unsigned sfs_read_file(const struct atr_image *atr, unsigned map, unsigned size,
+                       uint8_t *data)
+{
+    struct sfs_extent ext;
+    unsigned pos = 0;
+    sfs_extent_init(&ext, atr, map, size);
+    while( sfs_extent_next(&ext) )
+    {
+        memcpy(data + pos, ext.data, ext.len);
+        pos += ext.len;
+    }
+    return pos;
+}
+
+#ifdef SFS_WRITEV
+// Writes all the buffers, continuing after short writes
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+    while( cnt )
+    {
+        ssize_t n = writev(fd, iov, cnt);
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return -1;
+        while( cnt && (size_t)n >= iov->iov_len )
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if( cnt )
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+#endif
+
+int sfs_write_file(const struct atr_image *atr, unsigned map, unsigned size, int fd,
+                   unsigned *len)
+{
+    struct sfs_extent ext;
+    sfs_extent_init(&ext, atr, map, size);
+    *len = 0;
+#ifdef SFS_WRITEV
+    struct iovec iov[MAX_IOV];
+    int cnt        = 0;
+    unsigned start = 0;
+    for( ;; )
+    {
+        // Write the extents before the next one could evict them from the
+        // sector cache of images read on demand.
+        if( cnt == MAX_IOV ||
+            (cnt && ext.reads - start + SFS_EXTENT_SECTORS + 2 > ATR_CACHE_SECTORS) )
+        {
+            if( write_iov(fd, iov, cnt) )
+                return -1;
+            cnt = 0;
+        }
+        if( !cnt )
+            start = ext.reads;
+        if( !sfs_extent_next(&ext) )
+            break;
+        iov[cnt].iov_base = (void *)ext.data;
+        iov[cnt].iov_len  = ext.len;
+        cnt++;
+        *len += ext.len;
+    }
+    if( cnt && write_iov(fd, iov, cnt) )
+        return -1;
+#else
+    while( sfs_extent_next(&ext) )
+    {
+        if( ext.len != write(fd, ext.data, ext.len) )
+            return -1;
+        *len += ext.len;
+    }
+#endif
+    return 0;
+}
+
+unsigned sfs_get_name(char *name, char *aname, const uint8_t *data, int max, int lower_case)
+{
+    unsigned l = 0;
+    int dot    = 0;
+    memset(aname, ' ', max + 1);
+    aname[max + 1] = 0;
+    for( int i = 0; i < max; i++ )
+    {
+        uint8_t c = data[i];
+        if( c >= 'A' && c <= 'Z' && lower_case )
+            c = c - 'A' + 'a';
+        if( c < ' ' || c == '/' || c == '.' || c == '?' || c == '\\' || c == 96 || c > 'z' )
+            c = '_';
+        else if( c == ' ' )
+            continue;
+        if( i > 7 && !dot )
+        {
+            dot       = 1;
+            name[l++] = '.';
+        }
+        name[l++]      = c;
+        aname[i + dot] = c;
+    }
+    name[l] = 0;
+    return l;
+}
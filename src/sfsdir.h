@@ -0,0 +1,93 @@
+/*
+ *  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+/*
+ * Reads SpartaDOS file systems: an index of all the directories, and the
+ * data of the files without copying it.
+ */
+#pragma once
+#include "atr.h"
+#include <stdint.h>
+
+// One file or directory in the image
+struct sfs_entry
+{
+    const char *path;        // Full path, like "GAMES/GAME.COM", empty for the root
+    const char *name;        // Last part of the path
+    uint8_t aname[11];       // The 8+3 name, padded with spaces
+    struct sfs_entry *dir;   // Parent directory, null for the root
+    struct sfs_entry *child; // First entry of a directory, in directory order
+    struct sfs_entry *next;  // Next entry in the same directory
+    unsigned flags;          // Entry flags, 0x20 for directories
+    unsigned map;            // First sector map
+    unsigned size;           // Size in bytes
+    uint8_t date[3];         // Day, month and year
+    uint8_t time[3];         // Hours, minutes and seconds
+};
+
+struct sfs_index;
+
+// Reads all the directories of the image once, skipping unused and erased
+// entries. Returns null if the image does not have a SpartaDOS file system.
+struct sfs_index *sfs_index_load(struct atr_image *atr);
+// Returns the entry of the root directory.
+const struct sfs_entry *sfs_index_root(const struct sfs_index *idx);
+// Returns the entry with the given path, ignoring the case of the names and
+// any extra '/'. Returns null if not found.
+const struct sfs_entry *sfs_index_find(const struct sfs_index *idx, const char *path);
+// Frees the index and all the entries.
+void sfs_index_free(struct sfs_index *idx);
+
+// Max sectors in one extent
+#define SFS_EXTENT_SECTORS 64
+
+// Iterator over the data of a file, as extents pointing to the sector data in
+// the image. Consecutive sectors are joined in one extent when they are also
+// consecutive in memory. With images read on demand, the data is valid only
+// until ATR_CACHE_SECTORS other sectors are read, see "reads".
+struct sfs_extent
+{
+    const uint8_t *data; // Current extent, zeros for the holes of sparse files
+    unsigned len;        // Length of the current extent
+    unsigned reads;      // Sectors read from the image since the start
+    // Private
+    const struct atr_image *atr;
+    unsigned map;  // Current sector map
+    unsigned slot; // Position of the next data sector in the map
+    unsigned left; // Bytes of the file not returned yet
+    unsigned maps; // Maps read, to stop on loops
+};
+
+// Starts iterating "size" bytes of the file at the given map sector.
+void sfs_extent_init(struct sfs_extent *ext, const struct atr_image *atr, unsigned map,
+                     unsigned size);
+// Moves to the next extent. Returns 0 at the end of the data, also if the
+// file is shorter than the size, or on invalid sectors, showing a message.
+int sfs_extent_next(struct sfs_extent *ext);
+
+// Reads up to "size" bytes of the file at the given map sector, returns the
+// number of bytes read.
+unsigned sfs_read_file(const struct atr_image *atr, unsigned map, unsigned size,
+                       uint8_t *data);
+// Writes up to "size" bytes of the file at the given map sector to "fd",
+// directly from the image data. Sets "len" to the bytes written, returns 0 on
+// success or -1 on write errors, with errno set.
+int sfs_write_file(const struct atr_image *atr, unsigned map, unsigned size, int fd,
+                   unsigned *len);
+// Writes a host file name, and the "Atari" file name padded with spaces, from
+// the "max" characters of a name in a directory entry. Returns the length of
+// the host file name.
+unsigned sfs_get_name(char *name, char *aname, const uint8_t *data, int max, int lower_case);
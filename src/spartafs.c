@@ -22,6 +22,9 @@
 #include "asm/boot256.h"
 #include "crc32.h"
 #include "msg.h"
+#include "secmap.h"
+#include <ctype.h>
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -30,96 +33,99 @@ static char hex(int x)
     return ("0123456789ABCDEF")[x & 0x0F];
 }
 
+// The image is not stored contiguous: each sector points to the file data,
+// to a buffer owned by the image for metadata and partial sectors, or is null
+// for empty sectors. This keeps memory use proportional to the metadata.
 struct sfs
 {
-    uint8_t *data;
+    const uint8_t **sect;
+    darray(uint8_t *) bufs; // Owned sector buffers
     int nsec;
     int bmap;
     int nbmp;
     int csec;
     int boot_map;
     int sec_size;
+    int maps_first;     // Allocate all sector maps of a file before its data
+    struct secmap free; // Free sectors, stored in the bitmap when done
 };
 
-static uint8_t *sfs_ptr(struct sfs *sfs, int sec)
+// Seek-optimized layout, with the load order hint list sorted by name
+struct layout_name
 {
-    if( sec < 1 || sec > sfs->nsec )
-        return 0;
-    return sfs->data + sfs->sec_size * (sec - 1);
-}
+    char *name;
+    int pos;
+};
+static int layout_contiguous = 0;
+static struct layout_name *layout_order = 0;
+static int layout_count = 0;
 
-static void sfs_free_sec(struct sfs *sfs, int sec)
+// Allocates an owned buffer for "count" sectors starting at "sec"
+static uint8_t *sfs_new_buf(struct sfs *sfs, int sec, int count)
 {
-    if( sec < 1 || sec > sfs->nsec )
-        return;
-    uint8_t *bmap = sfs_ptr(sfs, sfs->bmap);
-    if( !bmap )
-        return;
-    bmap[sec >> 3] |= (128 >> (sec & 7));
+    uint8_t *buf = check_calloc(count, sfs->sec_size);
+    darray_add(&sfs->bufs, buf);
+    for( int i = 0; i < count; i++ )
+        sfs->sect[sec - 1 + i] = buf + sfs->sec_size * i;
+    return buf;
 }
 
-static int sfs_used(struct sfs *sfs, int sec)
+// Returns a writable pointer to the sector data, allocating an empty sector if
+// needed. Only sectors in owned buffers or directory data can be written.
+static uint8_t *sfs_ptr(struct sfs *sfs, int sec)
 {
     if( sec < 1 || sec > sfs->nsec )
-        return 1; // Treat out-of-bounds as used
-    uint8_t *bmap = sfs_ptr(sfs, sfs->bmap);
-    if( !bmap )
-        return 1;
-    return 0 == (bmap[sec >> 3] & (128 >> (sec & 7)));
+        return 0;
+    if( !sfs->sect[sec - 1] )
+        return sfs_new_buf(sfs, sec, 1);
+    return (uint8_t *)sfs->sect[sec - 1];
 }
 
 static int sfs_alloc(struct sfs *sfs)
 {
-    int sec = sfs->csec;
-    while( sec <= sfs->nsec && sfs_used(sfs, sec) )
-        sec++;
-    if( sec <= sfs->nsec )
-    {
-        sfs_ptr(sfs, sfs->bmap)[sec >> 3] &= ~(128 >> (sec & 7));
+    int sec = secmap_alloc(&sfs->free, sfs->csec);
+    if( sec >= 0 )
         sfs->csec = sec + 1;
-        return sec;
-    }
-    else
-        return -1;
+    return sec;
 }
 
-static int get_word(const uint8_t *data)
+// Allocates up to "count" contiguous sectors, returns the first and the length
+static int sfs_alloc_run(struct sfs *sfs, unsigned count, unsigned *len)
 {
-    return (data[0] & 0xFF) + ((data[1] & 0xFF) << 8);
+    int sec = secmap_alloc_run(&sfs->free, sfs->csec, count, len);
+    if( sec >= 0 )
+        sfs->csec = sec + *len;
+    return sec;
 }
 
-static int sfs_patch_byte(struct sfs *sfs, int smap, int pos, int byte)
+// Adds the data with its sector maps, returns the first map sector and stores
+// a writable pointer to the first data sector in "first_data", if given.
+static int sfs_add_data(struct sfs *sfs, char *data, int size, uint8_t **first_data)
 {
-    int mpos = 4;
-    while( pos >= sfs->sec_size )
+    int sec_size = sfs->sec_size;
+    int last = 0, first = 0, next = 0;
+    uint8_t *pmap = 0;
+    if( sfs->maps_first )
     {
-        pos -= sfs->sec_size;
-        mpos += 2;
-        if( mpos >= sfs->sec_size )
+        // Allocate all the sector maps in front of the data
+        int slots = (sec_size - 4) / 2;
+        int nd    = (size + sec_size - 1) / sec_size;
+        unsigned nmap = nd ? (nd + slots - 1) / slots : 1, len;
+        next = sfs_alloc_run(sfs, nmap, &len);
+        if( next < 0 )
+            return next;
+        if( len < nmap )
         {
-            mpos = 4;
-            smap = get_word(sfs_ptr(sfs, smap));
-            if( smap < 1 || smap > sfs->nsec )
-                return -1;
+            // Give back the short run, keeping the free map consistent
+            secmap_set_free(&sfs->free, next, len);
+            sfs->csec = next;
+            return -1;
         }
     }
-    int sect = get_word(sfs_ptr(sfs, smap) + mpos);
-    if( sect < 1 || sect > sfs->nsec )
-        return -1;
-    uint8_t *data = sfs_ptr(sfs, sect);
-    data[pos]     = byte;
-    return 0;
-}
-
-static int sfs_add_data(struct sfs *sfs, char *data, int size)
-{
-    int sec_size = sfs->sec_size;
-    int last = 0, first = 0;
-    uint8_t *pmap = 0;
     do
     {
         // Alloc a sector map
-        int smap = sfs_alloc(sfs);
+        int smap = next ? next++ : sfs_alloc(sfs);
         if( smap < 0 )
             return smap;
 
@@ -134,19 +140,31 @@ static int sfs_add_data(struct sfs *sfs, char *data, int size)
         pmap    = sfs_ptr(sfs, smap);
         pmap[2] = last & 0xFF;
         pmap[3] = last >> 8;
-        // Copy data
-        int i;
-        for( i = 4; i < sec_size && size > 0; i += 2 )
+        // Reference data, allocating runs of contiguous sectors
+        int i = 4;
+        while( i < sec_size && size > 0 )
         {
-            int num = size > sec_size ? sec_size : size;
-            int sec = sfs_alloc(sfs);
+            unsigned want = (size + sec_size - 1) / sec_size, len;
+            if( want > (unsigned)(sec_size - i) / 2 )
+                want = (sec_size - i) / 2;
+            int sec = sfs_alloc_run(sfs, want, &len);
             if( sec < 0 )
                 return sec;
-            pmap[i]     = sec & 0xFF;
-            pmap[i + 1] = sec >> 8;
-            memcpy(sfs_ptr(sfs, sec), data, num);
-            size -= num;
-            data += num;
+            for( unsigned j = 0; j < len; j++, i += 2 )
+            {
+                // Copy only the last partial sector
+                int num = size < sec_size ? size : sec_size;
+                if( num < sec_size )
+                    memcpy(sfs_new_buf(sfs, sec + j, 1), data, num);
+                else
+                    sfs->sect[sec + j - 1] = (const uint8_t *)data;
+                if( first_data && !*first_data )
+                    *first_data = (uint8_t *)sfs->sect[sec + j - 1];
+                data += num;
+                size -= num;
+                pmap[i]     = (sec + j) & 0xFF;
+                pmap[i + 1] = (sec + j) >> 8;
+            }
         }
         last = smap;
     } while( size );
@@ -186,7 +204,31 @@ static void write_boot(struct sfs *sfs, int address)
 
     // Copy boot sectors, always 128 byte size:
     for( i = 0; i < 3; i++ )
-        memcpy(sfs->data + sfs->sec_size * i, data + 128 * i, 128);
+        memcpy(sfs_ptr(sfs, i + 1), data + 128 * i, 128);
+}
+
+// Number of bitmap sectors for an image of the given geometry
+static int sfs_bitmap_sectors(int sector_size, long num_sectors)
+{
+    return ((num_sectors + 8) / 8 + sector_size - 1) / sector_size;
+}
+
+// Sets the size of all directories, one entry for the header and each file
+static void sfs_dir_sizes(file_list *flist)
+{
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        if( af->is_dir )
+            af->size = 23;
+    }
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        if( af->dir )
+            af->dir->size += 23;
+    }
 }
 
 // Sorting function: sort by level, then directories first and last by file name
@@ -201,86 +243,85 @@ static int compare_level(const void *a, const void *b)
     return strncmp(fa->aname, fb->aname, 11);
 }
 
-struct sfs *build_spartafs(int sector_size, int num_sectors, unsigned boot_addr,
-                           file_list *flist)
+// Writes the directory header, with the current size of the directory
+static void dir_header(struct afile *af, int parent)
 {
-    struct sfs *sfs = check_malloc(sizeof(struct sfs));
-    sfs->data       = check_calloc(sector_size, num_sectors);
-    sfs->nsec       = num_sectors;
-    sfs->bmap       = 4;
-    sfs->nbmp       = ((num_sectors + 8) / 8 + sector_size - 1) / sector_size;
-    sfs->csec       = 4 + sfs->nbmp;
-    sfs->sec_size   = sector_size;
-
-    write_boot(sfs, boot_addr);
+    int dsize   = af->size;
+    af->data[0] = 0x28;
+    af->data[1] = parent & 0xFF;
+    af->data[2] = parent >> 8;
+    af->data[3] = dsize & 0xFF;
+    af->data[4] = (dsize >> 8) & 0xFF;
+    af->data[5] = dsize >> 16;
+    memcpy(&af->data[6], af->aname, 11);
+    memcpy(&af->data[17], &af->date, 3);
+    memcpy(&af->data[20], &af->time, 3);
+}
 
-    int i;
-    for( i = sfs->csec; i <= sfs->nsec; i++ )
-        sfs_free_sec(sfs, i);
+// Appends the entry of the file, with the given size, to its directory
+static void dir_entry(struct afile *af, int size)
+{
+    struct afile *dir = af->dir;
+    char *cdir        = dir->data + dir->size;
+    int msec          = af->map_sect;
+
+    cdir[0] = 0x08 | (af->is_dir ? 0x20 : 0x00) | af->attribs;
+    cdir[1] = msec & 0xFF;
+    cdir[2] = msec >> 8;
+    cdir[3] = size & 0xFF;
+    cdir[4] = (size >> 8) & 0xFF;
+    cdir[5] = size >> 16;
+    memcpy(&cdir[6], af->aname, 11);
+    memcpy(&cdir[17], &af->date, 3);
+    memcpy(&cdir[20], &af->time, 3);
+
+    dir->size += 23;
+}
 
+// Adds all files in level order, the deepest directories first so that the
+// entries of each directory are known when it is added. Returns the map
+// sector of the main directory, 0 if not found or -1 on error.
+static int sfs_add_sorted(struct sfs *sfs, file_list *flist)
+{
     // Sort the entries by the level - higher level first
     qsort(&darray_i(flist, 0), darray_len(flist), sizeof(darray_i(flist, 0)),
           compare_level);
 
-    // Cleanup all directories
+    // Allocate all directories with their final size, and cleanup them
     struct afile **ptr;
     darray_foreach(ptr, flist)
     {
         struct afile *af = *ptr;
         if( af->is_dir )
         {
+            flist_dir_reserve(af, af->size);
             af->size = 23;
             memset(af->data, 0, 23);
         }
     }
 
-    // Add each file
-    int dsec = -1;
+    // Add each file, remembering the first sector of all directories
+    int dsec = 0;
+    uint8_t **dir_hdr = check_calloc(darray_len(flist), sizeof(uint8_t *));
     darray_foreach(ptr, flist)
     {
         struct afile *af = *ptr;
+        uint8_t **hdr    = &dir_hdr[ptr - &darray_i(flist, 0)];
+        // Parent dir map written later
         if( af->is_dir )
-        {
-            int dsize   = af->size;
-            af->data[0] = 0x28;
-            af->data[1] = 0; // Parent dir map,
-            af->data[2] = 0; // written later
-            af->data[3] = dsize & 0xFF;
-            af->data[4] = (dsize >> 8) & 0xFF;
-            af->data[5] = dsize >> 16;
-            memcpy(&af->data[6], af->aname, 11);
-            memcpy(&af->data[17], &af->date, 3);
-            memcpy(&af->data[20], &af->time, 3);
-        }
+            dir_header(af, 0);
         // Add data
-        int msec = sfs_add_data(sfs, af->data, af->size);
+        int msec = sfs_add_data(sfs, af->data, af->size, af->is_dir ? hdr : 0);
         if( msec < 0 )
         {
-            sfs_free(sfs);
-            return 0;
+            free(dir_hdr);
+            return msec;
         }
         // Set map sector
         af->map_sect = msec;
         // Add to directory
-        struct afile *dir = af->dir;
-        if( dir )
-        {
-            char *cdir = dir->data + dir->size;
-
-            cdir[0] = 0x08 | (af->is_dir ? 0x20 : 0x00) | af->attribs;
-            cdir[1] = msec & 0xFF;
-            cdir[2] = msec >> 8;
-            cdir[3] = af->size & 0xFF;
-            cdir[4] = (af->size >> 8) & 0xFF;
-            cdir[5] = af->size >> 16;
-            memcpy(&cdir[6], af->aname, 11);
-            memcpy(&cdir[17], &af->date, 3);
-            memcpy(&cdir[20], &af->time, 3);
-
-            dir->size += 23;
-            if( dir->size > SFS_MAX_DIR_SIZE )
-                show_error("too many files in directory %s.", dir->pname);
-        }
+        if( af->dir )
+            dir_entry(af, af->size);
         else
             // This is the main directory, remember location
             dsec = msec;
@@ -289,61 +330,333 @@ struct sfs *build_spartafs(int sector_size, int num_sectors, unsigned boot_addr,
             sfs->boot_map = msec;
     }
 
-    // Set the "parent" directory to all sub-directories
+    // Set the "parent" directory to all sub-directories, the parents are
+    // added after their sub-directories
     darray_foreach(ptr, flist)
     {
         struct afile *af = *ptr;
+        uint8_t *hdr     = dir_hdr[ptr - &darray_i(flist, 0)];
         if( af->is_dir && af->dir )
         {
             int parent = af->dir->map_sect;
-            sfs_patch_byte(sfs, af->map_sect, 1, parent & 0xFF);
-            sfs_patch_byte(sfs, af->map_sect, 2, parent >> 8);
+            hdr[1]     = parent & 0xFF;
+            hdr[2]     = parent >> 8;
         }
     }
+    free(dir_hdr);
+    return dsec;
+}
 
-    // Check main directory
+static int compare_layout_name(const void *a, const void *b)
+{
+    const struct layout_name *na = a;
+    const struct layout_name *nb = b;
+    int c = strcmp(na->name, nb->name);
+    return c ? c : na->pos - nb->pos;
+}
+
+// Returns the position in "layout_order" of the file name, or -1
+static int layout_find(const char *pname)
+{
+    int lo = 0, hi = layout_count;
+    while( lo < hi )
+    {
+        int mid = (lo + hi) / 2;
+        int c   = strcmp(layout_order[mid].name, pname);
+        if( !c )
+            return mid;
+        if( c < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+void sfs_set_layout(int contiguous, const char *const *order, int count,
+                    const file_list *flist)
+{
+    for( int i = 0; i < layout_count; i++ )
+        free(layout_order[i].name);
+    free(layout_order);
+    layout_order      = 0;
+    layout_count      = 0;
+    layout_contiguous = contiguous;
+    if( !contiguous || count <= 0 )
+        return;
+
+    // Store the names as in the file list: upper case, starting with '>'
+    layout_order = check_calloc(count, sizeof(struct layout_name));
+    for( int i = 0; i < count; i++ )
+    {
+        const char *src = order[i];
+        char *name      = check_malloc(strlen(src) + 2);
+        int n           = 0;
+        if( *src != '/' && *src != '\\' && *src != '>' )
+            name[n++] = '>';
+        for( ; *src; src++ )
+        {
+            char c    = *src;
+            name[n++] = (c == '/' || c == '\\') ? '>' : toupper((unsigned char)c);
+        }
+        name[n] = 0;
+        layout_order[i].name = name;
+        layout_order[i].pos  = i;
+    }
+    // Sort by name, dropping repeated names after the first position
+    qsort(layout_order, count, sizeof(struct layout_name), compare_layout_name);
+    for( int i = 0; i < count; i++ )
+    {
+        if( layout_count && !strcmp(layout_order[i].name, layout_order[layout_count - 1].name) )
+            free(layout_order[i].name);
+        else
+            layout_order[layout_count++] = layout_order[i];
+    }
+
+    // Report the names that match no file, in list order, as the layout would
+    // be silently wrong
+    char *missing = check_calloc(count, 1);
+    for( int i = 0; i < layout_count; i++ )
+        missing[layout_order[i].pos] = 1;
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        int i = layout_find((*ptr)->pname);
+        if( i >= 0 )
+            missing[layout_order[i].pos] = 0;
+    }
+    for( int i = 0; i < count; i++ )
+        if( missing[i] )
+            show_msg("load order: '%s' not found", order[i]);
+    free(missing);
+}
+
+// Placement of a file in the seek-optimized layout
+struct layout_item
+{
+    struct afile *af;
+    int rank;
+};
+
+// Rank in the layout: main directory, boot file and the load order hints,
+// all the other files last.
+static int layout_rank(const struct afile *af)
+{
+    if( !af->dir )
+        return 0;
+    if( af->boot_file )
+        return 1;
+    int i = layout_find(af->pname);
+    return i < 0 ? INT_MAX : 2 + layout_order[i].pos;
+}
+
+// Sorting function: sort by rank, then by level with directories first
+static int compare_layout(const void *a, const void *b)
+{
+    const struct layout_item *la = a;
+    const struct layout_item *lb = b;
+    if( la->rank != lb->rank )
+        return la->rank < lb->rank ? -1 : 1;
+    if( la->af->level != lb->af->level )
+        return la->af->level - lb->af->level;
+    if( la->af->is_dir != lb->af->is_dir )
+        return lb->af->is_dir - la->af->is_dir;
+    return strcmp(la->af->pname, lb->af->pname);
+}
+
+// Adds all files in the seek-optimized layout: the main directory, the boot
+// file and the load order hints first, then the rest from the top level down.
+// Each file gets its sector maps followed by one contiguous data run. As the
+// directories are placed before their contents, their data is reserved to
+// whole sectors and written when all the map sectors are known.
+static int sfs_add_contiguous(struct sfs *sfs, file_list *flist)
+{
+    int ss = sfs->sec_size;
+    int n  = darray_len(flist);
+    struct layout_item *items = check_malloc(n * sizeof(struct layout_item));
+    for( int i = 0; i < n; i++ )
+    {
+        items[i].af   = darray_i(flist, i);
+        items[i].rank = layout_rank(items[i].af);
+    }
+    qsort(items, n, sizeof(struct layout_item), compare_layout);
+    for( int i = 0; i < n; i++ )
+        darray_i(flist, i) = items[i].af;
+    free(items);
+
+    // Place all the files
+    int dsec = 0;
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        int size         = af->size;
+        if( af->is_dir )
+        {
+            size = (size + ss - 1) / ss * ss;
+            flist_dir_reserve(af, size);
+            memset(af->data, 0, size);
+        }
+        int msec = sfs_add_data(sfs, af->data, size, 0);
+        if( msec < 0 )
+            return msec;
+        af->map_sect = msec;
+        if( !af->dir )
+            dsec = msec;
+        if( af->boot_file )
+            sfs->boot_map = msec;
+    }
+
+    // Write the directories, in the same order as placed. The parents are
+    // written before their sub-directories are complete, so keep the final
+    // size of each directory for its entry.
+    int *full = check_malloc(n * sizeof(int));
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        full[ptr - &darray_i(flist, 0)] = af->size;
+        if( af->is_dir )
+        {
+            dir_header(af, af->dir ? af->dir->map_sect : 0);
+            af->size = 23;
+        }
+    }
+    darray_foreach(ptr, flist)
+    {
+        if( (*ptr)->dir )
+            dir_entry(*ptr, full[ptr - &darray_i(flist, 0)]);
+    }
+    free(full);
+    return dsec;
+}
+
+struct sfs *build_spartafs(int sector_size, int num_sectors, unsigned boot_addr,
+                           file_list *flist)
+{
+    struct sfs *sfs = check_malloc(sizeof(struct sfs));
+    sfs->sect       = check_calloc(num_sectors, sizeof(sfs->sect[0]));
+    sfs->nsec       = num_sectors;
+    sfs->bmap       = 4;
+    sfs->nbmp       = sfs_bitmap_sectors(sector_size, num_sectors);
+    sfs->csec       = 4 + sfs->nbmp;
+    sfs->boot_map   = 0;
+    sfs->sec_size   = sector_size;
+    sfs->maps_first = layout_contiguous;
+    darray_init(sfs->bufs, 1);
+
+    write_boot(sfs, boot_addr);
+
+    secmap_init(&sfs->free, num_sectors);
+    secmap_set_free(&sfs->free, sfs->csec, num_sectors - sfs->csec + 1);
+
+    // Get the final size of all directories
+    sfs_dir_sizes(flist);
+    struct afile **ptr;
+    darray_foreach(ptr, flist)
+    {
+        struct afile *af = *ptr;
+        if( af->is_dir && af->size > SFS_MAX_DIR_SIZE )
+            show_error("too many files in directory %s.", af->pname);
+    }
+
+    int dsec = layout_contiguous ? sfs_add_contiguous(sfs, flist) : sfs_add_sorted(sfs, flist);
     if( dsec < 0 )
+    {
+        sfs_free(sfs);
+        return 0;
+    }
+
+    // Check main directory
+    if( !dsec )
         show_error("internal error - no main directory.");
 
-    // Get's CRC32 of current data
-    unsigned crc = crc32(0, sfs->data, sfs->sec_size * sfs->nsec);
-
-    sfs->data[1]  = 0x03;
-    sfs->data[7]  = 0x80;
-    sfs->data[9]  = dsec & 0xFF;
-    sfs->data[10] = dsec >> 8;
-    sfs->data[11] = sfs->nsec & 0xFF;
-    sfs->data[12] = sfs->nsec >> 8;
-    sfs->data[13] = (sfs->nsec - sfs->csec + 1) & 0xFF;
-    sfs->data[14] = (sfs->nsec - sfs->csec + 1) >> 8;
-    sfs->data[15] = sfs->nbmp;
-    sfs->data[16] = sfs->bmap & 0xFF;
-    sfs->data[17] = sfs->bmap >> 8;
-    sfs->data[18] = sfs->csec & 0xFF;
-    sfs->data[19] = sfs->csec >> 8;
-    sfs->data[20] = sfs->csec & 0xFF;
-    sfs->data[21] = sfs->csec >> 8;
-    sfs->data[22] = 'D';
-    sfs->data[23] = 'S';
-    sfs->data[24] = 'K';
-    sfs->data[25] = '_';
-    sfs->data[26] = hex(crc >> 8);
-    sfs->data[27] = hex(crc >> 12);
-    sfs->data[28] = hex(crc >> 16);
-    sfs->data[29] = hex(crc >> 20);
-    sfs->data[30] = 0x28;
-    sfs->data[31] = sfs->sec_size > 128 ? 0 : 128;
-    sfs->data[32] = 0x20;
-    sfs->data[39] = crc & 0xFF;
-    sfs->data[40] = sfs->boot_map & 0xFF;
-    sfs->data[41] = sfs->boot_map >> 8;
+    // Store the free sector bitmap
+    secmap_store_sparta(&sfs->free, sfs_new_buf(sfs, sfs->bmap, sfs->nbmp));
+
+    // Get's CRC32 of current data, empty sectors are zeros
+    unsigned crc = 0;
+    uint8_t *zero = check_calloc(1, sfs->sec_size);
+    for( int i = 0; i < sfs->nsec; i++ )
+        crc = crc32(crc, sfs->sect[i] ? sfs->sect[i] : zero, sfs->sec_size);
+    free(zero);
+
+    uint8_t *sb = sfs_ptr(sfs, 1);
+    sb[1]  = 0x03;
+    sb[7]  = 0x80;
+    sb[9]  = dsec & 0xFF;
+    sb[10] = dsec >> 8;
+    sb[11] = sfs->nsec & 0xFF;
+    sb[12] = sfs->nsec >> 8;
+    sb[13] = (sfs->nsec - sfs->csec + 1) & 0xFF;
+    sb[14] = (sfs->nsec - sfs->csec + 1) >> 8;
+    sb[15] = sfs->nbmp;
+    sb[16] = sfs->bmap & 0xFF;
+    sb[17] = sfs->bmap >> 8;
+    sb[18] = sfs->csec & 0xFF;
+    sb[19] = sfs->csec >> 8;
+    sb[20] = sfs->csec & 0xFF;
+    sb[21] = sfs->csec >> 8;
+    sb[22] = 'D';
+    sb[23] = 'S';
+    sb[24] = 'K';
+    sb[25] = '_';
+    sb[26] = hex(crc >> 8);
+    sb[27] = hex(crc >> 12);
+    sb[28] = hex(crc >> 16);
+    sb[29] = hex(crc >> 20);
+    sb[30] = 0x28;
+    sb[31] = sfs->sec_size > 128 ? 0 : 128;
+    sb[32] = 0x20;
+    sb[39] = crc & 0xFF;
+    sb[40] = sfs->boot_map & 0xFF;
+    sb[41] = sfs->boot_map >> 8;
 
     return sfs;
 }
 
-uint8_t *sfs_get_data(const struct sfs *sfs)
+// Number of sectors used by a file or directory of the given size
+static int sfs_file_sectors(int sector_size, size_t size)
 {
-    return sfs->data;
+    int slots = (sector_size - 4) / 2;
+    int nd    = (size + sector_size - 1) / sector_size;
+    return nd + (nd ? (nd + slots - 1) / slots : 1);
+}
+
+// Number of sectors used by all files and directories, also sets the size of
+// the directories.
+static long sfs_used_sectors(int sector_size, file_list *flist)
+{
+    sfs_dir_sizes(flist);
+
+    struct afile **ptr;
+    long used = 0;
+    darray_foreach(ptr, flist)
+    {
+        used += sfs_file_sectors(sector_size, (*ptr)->size);
+    }
+    return used;
+}
+
+int sfs_plan(int sector_size, file_list *flist)
+{
+    long used = sfs_used_sectors(sector_size, flist);
+
+    // Add boot sectors and bitmap, the bitmap grows with the number of sectors
+    long nsec = used + 3 + 1;
+    while( nsec <= 65535 && nsec < used + 3 + sfs_bitmap_sectors(sector_size, nsec) )
+        nsec++;
+    return nsec <= 65535 ? nsec : -1;
+}
+
+int sfs_plan_free(int sector_size, int num_sectors, file_list *flist)
+{
+    long used = sfs_used_sectors(sector_size, flist);
+    return num_sectors - 3 - sfs_bitmap_sectors(sector_size, num_sectors) - used;
+}
+
+const uint8_t *const *sfs_get_sectors(const struct sfs *sfs)
+{
+    return sfs->sect;
 }
 
 int sfs_get_num_sectors(const struct sfs *sfs)
@@ -365,7 +678,14 @@ void sfs_free(struct sfs *sfs)
 {
     if( sfs )
     {
-        free(sfs->data);
+        uint8_t **buf;
+        darray_foreach(buf, &sfs->bufs)
+        {
+            free(*buf);
+        }
+        darray_delete(sfs->bufs);
+        secmap_delete(&sfs->free);
+        free(sfs->sect);
         free(sfs);
     }
 }
@@ -25,8 +25,24 @@ struct sfs;
 
 struct sfs *build_spartafs(int sector_size, int num_sectors, unsigned boot_addr,
                            file_list *flist);
+// Selects the seek-optimized layout for the next images built: the main
+// directory, the boot file and then the files named in "order" are stored
+// first, each file with its sector maps in front of one contiguous run of
+// data. Names are full paths, like "/GAMES/GAME.COM", the ones not found in
+// "flist" are reported.
+void sfs_set_layout(int contiguous, const char *const *order, int count,
+                    const file_list *flist);
+// Returns the minimum number of sectors of the given size for an image holding
+// all the files, or -1 if it does not fit in 65535 sectors. Also sets the size
+// of the directories.
+int sfs_plan(int sector_size, file_list *flist);
+// Returns the number of sectors left free in an image of the given geometry
+// holding all the files, negative if the files do not fit.
+int sfs_plan_free(int sector_size, int num_sectors, file_list *flist);
 
-uint8_t *sfs_get_data(const struct sfs *);
+// Returns the data of each sector, null for empty sectors. The sectors can
+// point to the file data, so the file list must be kept until written.
+const uint8_t *const *sfs_get_sectors(const struct sfs *);
 int sfs_get_num_sectors(const struct sfs *);
 int sfs_get_sector_size(const struct sfs *);
 int sfs_get_free_sectors(const struct sfs *);
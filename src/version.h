@@ -0,0 +1,2 @@
+#pragma once
+const char *prog_version = "<<<<<<< HEAD 1.0.77 ======= 1.0.74 >>>>>>> develop";
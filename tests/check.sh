@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+#  Copyright (C) 2026 Rick Collette & AtariFoundry.com
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License along
+#  with this program.  If not, see <http://www.gnu.org/licenses/>
+#
+# Builds images with atrforge, modifies them with atrcp, and checks the file
+# system with sfscheck after each step. Run with "make check".
+#
+# Usage: tests/check.sh <bin_dir>
+
+set -e
+
+BIN=$(cd "${1:-bin}" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Runs a program, showing the messages only on errors
+run() {
+    if ! "$@" > "$TMP/log" 2>&1; then
+        cat "$TMP/log"
+        echo "FAILED: $*"
+        exit 1
+    fi
+}
+
+# Writes a file of the given number of bytes
+mkfile() {
+    seq 1 "$2" | head -c "$2" > "$1"
+}
+
+# Checks the image, and that the file in the image matches the host file
+check() {
+    "$BIN/sfscheck" "$1"
+    if [ -n "$2" ]; then
+        run "$BIN/atrcp" "$1:$2" "$TMP/out"
+        cmp "$TMP/out" "$3"
+        rm -f "$TMP/out"
+    fi
+}
+
+# Source tree, with directories of more than one sector
+mkdir -p "$TMP/src/SUB/DEEP"
+mkfile "$TMP/src/SMALL.TXT" 100
+mkfile "$TMP/src/BIG.BIN" 40000
+i=0
+while [ $i -lt 24 ]; do
+    mkfile "$TMP/src/SUB/F$i.DAT" $((i * 700 + 1))
+    i=$((i + 1))
+done
+mkfile "$TMP/src/SUB/DEEP/D.TXT" 3000
+mkfile "$TMP/NEW.BIN" 20000
+
+for opts in "" "--contiguous" "-x"; do
+    echo "Checking atrforge $opts"
+    img="$TMP/test.atr"
+    rm -f "$img"
+    # atrforge does not recurse, list directories before their files
+    (cd "$TMP/src" && run "$BIN/atrforge" $opts "$img" $(find . | sed -n 's|^\./||p' | sort))
+    check "$img" SUB/DEEP/D.TXT "$TMP/src/SUB/DEEP/D.TXT"
+
+    # Exact size images have no free sectors
+    [ "$opts" = "-x" ] && continue
+
+    run "$BIN/atrcp" "$TMP/NEW.BIN" "$img:SUB/NEW.BIN"
+    check "$img" SUB/NEW.BIN "$TMP/NEW.BIN"
+
+    run "$BIN/atrcp" "$TMP/src/SMALL.TXT" "$img:SUB/NEW.BIN"
+    check "$img" SUB/NEW.BIN "$TMP/src/SMALL.TXT"
+
+    run "$BIN/atrcp" "$img:SUB/F3.DAT" "$img:SUB/DEEP/MOVED.DAT"
+    check "$img" SUB/DEEP/MOVED.DAT "$TMP/src/SUB/F3.DAT"
+
+    run "$BIN/atrcp" --delete "$img:BIG.BIN"
+    check "$img"
+
+    run "$BIN/atrcp" --delete "$img:SUB/DEEP/D.TXT"
+    run "$BIN/atrcp" --delete "$img:SUB/DEEP/MOVED.DAT"
+    run "$BIN/atrcp" --delete "$img:SUB/DEEP"
+    check "$img"
+
+    (cd "$TMP/src" && run "$BIN/atrforge" -a "$img" BIG.BIN)
+    check "$img" BIG.BIN "$TMP/src/BIG.BIN"
+done
+
+echo "All checks passed"